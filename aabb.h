@@ -3,6 +3,7 @@
 
 #include "ray.h"
 #include "vec3.h"
+#include <limits>
 
 class AABB
 {
@@ -22,39 +23,75 @@ public:
     return AABB(new_min, new_max);
   }
 
-  // Check if a ray intersects this AABB
+  // An inverted box that any combine() will replace, used to start accumulating bounds
+  static AABB empty()
+  {
+    real inf = std::numeric_limits<real>::infinity();
+    return AABB(vec3(inf, inf, inf), vec3(-inf, -inf, -inf));
+  }
+
+  // Grow the box to contain a point
+  void extend(const vec3 &p)
+  {
+    min = vec3::min(min, p);
+    max = vec3::max(max, p);
+  }
+
+  vec3 centroid() const
+  {
+    return (min + max) * 0.5;
+  }
+
+  // Surface area of the box, used by the SAH cost model. Empty boxes have zero area.
+  real surface_area() const
+  {
+    vec3 d = max - min;
+    if (d.x < 0.0 || d.y < 0.0 || d.z < 0.0)
+      return 0.0;
+    return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
+  }
+
+  // Corner the ray enters through on each axis when sign is 0 (min), leaves through when 1 (max)
+  const vec3 &bound(int sign) const { return sign ? max : min; }
 
-  bool hit(const ray &r, double &t_min, double &t_max) const
+  // Check if a ray intersects this AABB, narrowing [t_min, t_max] to the overlap. Branchless slab
+  // test on the ray's cached reciprocal direction: its signs pick the near and far planes, so no
+  // swap is needed. An axis-parallel ray gets +-inf slab distances; when its origin lies exactly
+  // on a plane the distance is NaN, and the comparisons are ordered so a NaN leaves the interval
+  // unchanged instead of poisoning it.
+  bool hit(const ray &r, real &t_min, real &t_max) const
   {
-    // std::cout << "bbox intersection CHECK" << std::endl;
-    const vec3 orig = r.origin;
-    const vec3 dir = r.direction;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      real t0 = (bound(r.sign[axis])[axis] - r.origin[axis]) * r.inv_direction[axis];
+      real t1 = (bound(1 - r.sign[axis])[axis] - r.origin[axis]) * r.inv_direction[axis];
+      t_min = t0 > t_min ? t0 : t_min;
+      t_max = t1 < t_max ? t1 : t_max;
+    }
+    return t_min < t_max;
+  }
 
-    // Iterate over each axis (x, y, z)
+  // Conservative variant for acceleration structures, where a falsely rejected box loses every
+  // primitive inside it. The far distance is widened by 2 * gamma(3) (Ize, "Robust BVH Ray
+  // Traversal"), which bounds the rounding error of the three operations above, and a box the
+  // ray only touches still counts as hit.
+  bool hit_robust(const ray &r, real &t_min, real &t_max) const
+  {
+    const real far_scale = 1.0 + 2.0 * gamma(3);
     for (int axis = 0; axis < 3; ++axis)
     {
-      // Calculate the inverse of the ray's direction component for the current axis
-      double inv_d = 1.0 / (axis == 0 ? dir.x : (axis == 1 ? dir.y : dir.z));
-
-      // Calculate the intersection times along the ray's path
-      double t0 = ((axis == 0 ? min.x : (axis == 1 ? min.y : min.z)) - (axis == 0 ? orig.x : (axis == 1 ? orig.y : orig.z))) * inv_d;
-      double t1 = ((axis == 0 ? max.x : (axis == 1 ? max.y : max.z)) - (axis == 0 ? orig.x : (axis == 1 ? orig.y : orig.z))) * inv_d;
-      // If the direction is negative, swap t0 and t1
-      if (inv_d < 0.0)
-        std::swap(t0, t1);
-
-      // Update the ray's min and max values for this axis
-      t_min = std::max(t0, t_min);
-      t_max = std::min(t1, t_max);
-
-      // If the ray doesn't intersect the box, return false
-      if (t_max <= t_min)
-      {
-        return false;
-      }
+      real t0 = (bound(r.sign[axis])[axis] - r.origin[axis]) * r.inv_direction[axis];
+      real t1 = (bound(1 - r.sign[axis])[axis] - r.origin[axis]) * r.inv_direction[axis] * far_scale;
+      t_min = t0 > t_min ? t0 : t_min;
+      t_max = t1 < t_max ? t1 : t_max;
     }
-    //  If we get here, the ray intersects the AABB
-    return true;
+    return t_min <= t_max;
+  }
+
+  // Bound on the relative error of n chained floating-point operations
+  static constexpr real gamma(int n)
+  {
+    return n * 0.5 * std::numeric_limits<real>::epsilon() / (1.0 - n * 0.5 * std::numeric_limits<real>::epsilon());
   }
 };
 
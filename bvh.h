@@ -3,66 +3,418 @@
 
 #include "aabb.h"
 #include "hittable.h"
+#include "util.h"
 // #include "hittable_list.h"
-#include <algorithm> // For std::sort
+#include <algorithm> // For std::partition, std::nth_element
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
 
-class bvh_node : public Hittable
+// Top-down binned SAH gives the best trees; LBVH sorts primitives along a Morton curve and
+// builds in linear time, trading some tree quality for much faster startup
+enum class BVHBuildMethod
+{
+  sah,
+  lbvh
+};
+
+// Tunables for the BVH builders
+struct BVHBuildOptions
+{
+  BVHBuildMethod method = BVHBuildMethod::sah;
+  int bin_count = 16;               // Centroid bins per axis when evaluating split planes (2 to 64)
+  double traversal_cost = 1.0;      // Relative cost of visiting an interior node
+  double intersection_cost = 1.0;   // Relative cost of intersecting one primitive
+  double leaf_cost_threshold = 2.0; // Nodes whose leaf cost is at or below this skip binning: a leaf if they fit, else a median split
+  int max_leaf_size = 4;            // Most primitives per leaf (1 to 64); smaller nodes become leaves when splitting costs more
+  int width = 0;                    // Children per node of the flattened tree: 2, 4 or 8, or 0 to pick from CPU features
+  unsigned threads = 0;             // Build threads, 0 for every thread of the shared pool
+  int treelet_passes = 0;           // LBVH only: rounds of SAH treelet restructuring after the Morton build
+  int treelet_size = 7;             // LBVH only: leaves per restructured treelet (3 to 8)
+  std::string cache_dir;            // Directory of .rtbvh files to load built trees from and save them to, empty to always build
+};
+
+// Summary of a finished build, filled in when a stats pointer is handed to the builder
+struct BVHBuildStats
+{
+  size_t primitives = 0;
+  size_t interior_nodes = 0;
+  size_t leaf_nodes = 0;
+  int max_depth = 0;
+  double sah_cost = 0.0; // Expected cost of a ray that hits the root box, in units of the cost model
+  double build_ms = 0.0;
+  std::string builder; // "sah" or "lbvh"
+  std::string layout;  // Traversal layout chosen for the tree, e.g. "bvh8/avx2"
+  std::string cache;   // "hit" when the tree was loaded from the BVH cache, "written" when it was saved to it
+
+  // Raw surface area sums, normalized by the root area into sah_cost when the build finishes
+  double interior_area = 0.0;
+  double leaf_area = 0.0;
+
+  // Fold in the counts of a subtree built separately
+  void merge(const BVHBuildStats &other)
+  {
+    interior_nodes += other.interior_nodes;
+    leaf_nodes += other.leaf_nodes;
+    max_depth = std::max(max_depth, other.max_depth);
+    interior_area += other.interior_area;
+    leaf_area += other.leaf_area;
+  }
+
+  // Stamp the totals once the whole tree is built
+  void finish(size_t prim_count, double root_area, const BVHBuildOptions &options,
+              std::chrono::steady_clock::time_point build_start)
+  {
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - build_start;
+    primitives = prim_count;
+    build_ms = elapsed.count();
+    builder = options.method == BVHBuildMethod::lbvh ? "lbvh" : "sah";
+    sah_cost = root_area > 0.0 ? (options.traversal_cost * interior_area + options.intersection_cost * leaf_area) / root_area
+                               : 0.0;
+  }
+
+  void print(const std::string &label) const
+  {
+    std::cout << "BVH (" << label << "): " << primitives << " primitives, "
+              << interior_nodes << " interior / " << leaf_nodes << " leaf nodes, depth " << max_depth
+              << ", SAH cost " << sah_cost << ", built";
+    if (!builder.empty())
+      std::cout << " by " << builder;
+    std::cout << (cache == "hit" ? ", loaded" : "") << " in " << build_ms << " ms";
+    if (!layout.empty())
+      std::cout << ", " << layout;
+    if (!cache.empty())
+      std::cout << ", cache " << cache;
+    std::cout << std::endl;
+  }
+};
+
+// Best split found for one node
+struct BVHSplit
+{
+  int axis = -1; // -1 when the centroids coincide and no plane can separate them
+  int bin = 0;   // Primitives whose centroid lands in a bin below this one go left
+  double cost = std::numeric_limits<double>::infinity();
+  double centroid_min = 0.0;
+  double bin_scale = 0.0; // bin_count / centroid extent along axis
+
+  int bin_of(const vec3 &centroid, int bin_count) const
+  {
+    int b = static_cast<int>((centroid[axis] - centroid_min) * bin_scale);
+    return std::min(std::max(b, 0), bin_count - 1);
+  }
+};
+
+// Per-axis SAH bins for one node. Binning only takes box unions and counts, so bins filled by
+// separate threads over disjoint chunks merge into exactly what a serial pass would produce.
+struct SAHBins
+{
+  static const int max_bins = 64;
+
+  int bin_count;
+  AABB centroid_box;
+  vec3 bin_scale;                // bin_count / centroid extent per axis, 0 on flat axes
+  AABB boxes[3 * max_bins];      // Axis-major, first bin_count of each axis in use
+  size_t counts[3 * max_bins];
+
+  // Bin count actually used for a requested one
+  static int bin_limit(int bins) { return std::min(std::max(bins, 2), int(max_bins)); }
+
+  SAHBins(int bins, const AABB &centroid_box)
+      : bin_count(bin_limit(bins)), centroid_box(centroid_box)
+  {
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      std::fill(boxes + axis * max_bins, boxes + axis * max_bins + bin_count, AABB::empty());
+      std::fill(counts + axis * max_bins, counts + axis * max_bins + bin_count, 0);
+
+      double extent = centroid_box.max[axis] - centroid_box.min[axis];
+      bin_scale[axis] = extent > 0.0 ? bin_count / extent : 0.0;
+    }
+  }
+
+  BVHSplit axis_split(int axis) const
+  {
+    BVHSplit split;
+    split.axis = axis;
+    split.centroid_min = centroid_box.min[axis];
+    split.bin_scale = bin_scale[axis];
+    return split;
+  }
+
+  void add(const AABB &box)
+  {
+    vec3 centroid = box.centroid();
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      if (bin_scale[axis] == 0.0)
+        continue;
+      int b = axis * max_bins + axis_split(axis).bin_of(centroid, bin_count);
+      boxes[b] = AABB::combine(boxes[b], box);
+      counts[b]++;
+    }
+  }
+
+  void merge(const SAHBins &other)
+  {
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      for (int b = axis * max_bins; b < axis * max_bins + bin_count; ++b)
+      {
+        boxes[b] = AABB::combine(boxes[b], other.boxes[b]);
+        counts[b] += other.counts[b];
+      }
+    }
+  }
+
+  // Price every plane between neighbouring bins and return the cheapest
+  BVHSplit best_split(const AABB &node_box, const BVHBuildOptions &options) const
+  {
+    BVHSplit best;
+    double node_area = node_box.surface_area();
+    double inv_area = node_area > 0.0 ? 1.0 / node_area : 1.0;
+
+    double right_area[max_bins];
+    size_t right_count[max_bins];
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      if (bin_scale[axis] == 0.0)
+        continue;
+
+      const AABB *axis_boxes = boxes + axis * max_bins;
+      const size_t *axis_counts = counts + axis * max_bins;
+
+      // Sweep from the right so each plane knows what lies above it
+      AABB acc = AABB::empty();
+      size_t count = 0;
+      for (int b = bin_count - 1; b > 0; --b)
+      {
+        acc = AABB::combine(acc, axis_boxes[b]);
+        count += axis_counts[b];
+        right_area[b] = acc.surface_area();
+        right_count[b] = count;
+      }
+
+      // Sweep from the left, pricing the plane between bin b - 1 and bin b
+      acc = AABB::empty();
+      count = 0;
+      for (int b = 1; b < bin_count; ++b)
+      {
+        acc = AABB::combine(acc, axis_boxes[b - 1]);
+        count += axis_counts[b - 1];
+        if (count == 0 || right_count[b] == 0)
+          continue;
+
+        double cost = options.traversal_cost +
+                      options.intersection_cost * inv_area *
+                          (acc.surface_area() * count + right_area[b] * right_count[b]);
+        if (cost < best.cost)
+        {
+          best = axis_split(axis);
+          best.bin = b;
+          best.cost = cost;
+        }
+      }
+    }
+
+    return best;
+  }
+};
+
+// Split selection shared by the BVH builders. bounds_of(item) must return the item's AABB.
+class BVHBuilder
 {
 public:
-  Hittable *left;
-  Hittable *right;
-  // Constructor that accepts a vector of hittable objects and start/end indices
-  bvh_node(Hittable **objects, size_t start, size_t end)
+  // Evaluate the binned Surface Area Heuristic on all three axes and return the cheapest plane
+  template <typename T, typename BoundsFn>
+  static BVHSplit find_sah_split(T *first, T *last, const AABB &node_box, BoundsFn bounds_of, const BVHBuildOptions &options)
+  {
+    AABB centroid_box = AABB::empty();
+    for (T *it = first; it != last; ++it)
+      centroid_box.extend(bounds_of(*it).centroid());
+
+    SAHBins bins(options.bin_count, centroid_box);
+    for (T *it = first; it != last; ++it)
+      bins.add(bounds_of(*it));
+
+    return bins.best_split(node_box, options);
+  }
+
+  // Reorder [first, last) so primitives left of the split come first, returning the boundary
+  template <typename T, typename BoundsFn>
+  static T *partition(T *first, T *last, const BVHSplit &split, BoundsFn bounds_of, const BVHBuildOptions &options)
+  {
+    int bin_count = SAHBins::bin_limit(options.bin_count);
+    return std::partition(first, last, [&](const T &item)
+                          { return split.bin_of(bounds_of(item).centroid(), bin_count) < split.bin; });
+  }
+
+  // Largest leaf the builders may create
+  static size_t max_leaf_size(const BVHBuildOptions &options)
+  {
+    return static_cast<size_t>(std::min(std::max(options.max_leaf_size, 1), 64));
+  }
+
+  // Nodes whose leaf cost is at or below leaf_cost_threshold are not worth binning
+  static bool small_node(size_t span, const BVHBuildOptions &options)
   {
+    return span * options.intersection_cost <= options.leaf_cost_threshold;
+  }
+
+  // Nodes that become leaves before any split is evaluated: single primitives, and small nodes
+  // that fit in a leaf
+  static bool leaf_without_split(size_t span, const BVHBuildOptions &options)
+  {
+    return span == 1 || (small_node(span, options) && span <= max_leaf_size(options));
+  }
+
+  // Cost-based termination: a node that fits in a leaf stays one unless the best split is
+  // cheaper than intersecting all of its primitives. With no split found (split.cost is
+  // infinite) every node that fits becomes a leaf.
+  static bool keep_as_leaf(size_t span, const BVHSplit &split, const BVHBuildOptions &options)
+  {
+    return span <= max_leaf_size(options) && span * options.intersection_cost <= split.cost;
+  }
+
+  // Object median along the axis with the widest centroid spread, for small or degenerate nodes.
+  // The axis is reported through axis_out; the lower half of the centroids ends up on the left.
+  template <typename T, typename BoundsFn>
+  static T *median_split(T *first, T *last, BoundsFn bounds_of, int *axis_out = nullptr)
+  {
+    AABB centroid_box = AABB::empty();
+    for (T *it = first; it != last; ++it)
+      centroid_box.extend(bounds_of(*it).centroid());
+
+    vec3 extent = centroid_box.max - centroid_box.min;
+    int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+
+    if (axis_out)
+      *axis_out = axis;
+
+    T *mid = first + (last - first) / 2;
+    std::nth_element(first, mid, last, [&](const T &a, const T &b)
+                     { return bounds_of(a).centroid()[axis] < bounds_of(b).centroid()[axis]; });
+    return mid;
+  }
+};
 
-    // std::cout << "bvh_constructor" << std::endl;
-    //   Choose a random axis to split along (0 = x-axis, 1 = y-axis, 2 = z-axis)
-    int axis = Util::random_int(0, 2);
+class bvh_node : public Hittable
+{
+public:
+  // Children of an interior node; both null for a leaf
+  Hittable *left = nullptr;
+  Hittable *right = nullptr;
+  // Objects of a leaf, intersected in one loop; empty for an interior node
+  std::vector<Hittable *> leaf_objects;
 
-    // Choose a comparison function based on the axis
-    auto comparator = (axis == 0)   ? box_x_compare
-                      : (axis == 1) ? box_y_compare
-                                    : box_z_compare;
+  // Constructor that accepts a vector of hittable objects and start/end indices.
+  // Pass a stats pointer to the root call to get a build report.
+  bvh_node(Hittable **objects, size_t start, size_t end,
+           const BVHBuildOptions &options = BVHBuildOptions(), BVHBuildStats *stats = nullptr, int depth = 0)
+  {
+    auto build_start = std::chrono::steady_clock::now();
+    auto bounds_of = [](const Hittable *object)
+    { return object->getBoundingBox(); };
 
     size_t object_span = end - start;
+    Hittable **first = objects + start;
+    Hittable **last = objects + end;
 
-    if (object_span == 1)
+    bbox = AABB::empty();
+    for (Hittable **it = first; it != last; ++it)
+      bbox = AABB::combine(bbox, (*it)->getBoundingBox());
+
+    BVHSplit split;
+    Hittable **mid = nullptr;
+    if (!BVHBuilder::leaf_without_split(object_span, options))
     {
-      left = objects[start];
+      if (!BVHBuilder::small_node(object_span, options))
+        split = BVHBuilder::find_sah_split(first, last, bbox, bounds_of, options);
 
-      right = objects[start];
+      if (!BVHBuilder::keep_as_leaf(object_span, split, options))
+      {
+        if (split.axis >= 0)
+        {
+          mid = BVHBuilder::partition(first, last, split, bounds_of, options);
+          axis = split.axis;
+        }
+        else
+        {
+          mid = BVHBuilder::median_split(first, last, bounds_of, &axis);
+        }
+      }
     }
-    else if (object_span == 2)
+
+    if (mid == nullptr)
     {
-      // std::cout << "FIRST " << left->bounding_box.min << std::endl;
-      left = objects[start];
-      right = objects[start + 1];
+      leaf_objects.assign(first, last);
     }
     else
     {
-      // Sort the objects based on the chosen axis
-      std::sort(objects + start, objects + end, comparator);
-
-      size_t mid = start + object_span / 2;
-      left = new bvh_node(objects, start, mid);
-      right = new bvh_node(objects, mid, end);
+      size_t mid_index = mid - objects;
+      left = new bvh_node(objects, start, mid_index, options, stats, depth + 1);
+      right = new bvh_node(objects, mid_index, end, options, stats, depth + 1);
     }
 
-    // Combine the bounding boxes of the left and right children to get the bounding box of this node
-    bbox = AABB::combine(left->getBoundingBox(), right->getBoundingBox());
+    if (stats)
+      record_stats(*stats, object_span, depth, options, build_start);
   }
 
   // Recursively Check if the ray intersects with this BVH node and its children
-  bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override
+  bool intersect(const ray &r, real t_min, real t_max, hit_record &rec) const override
   {
-    //  First, check if the ray intersects the bounding box of this node
-    if (!bbox.hit(r, t_min, t_max))
+    //  First, check if the ray intersects the bounding box of this node. The box test narrows its
+    //  interval, so hand it a copy: primitives lying on the box boundary would otherwise be clipped.
+    real box_min = t_min, box_max = t_max;
+    if (!bbox.hit_robust(r, box_min, box_max))
       return false;
 
-    bool hit_left = left->hit(r, t_min, t_max, rec);
-    bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+    if (left == nullptr)
+    {
+      bool hit_anything = false;
+      for (const Hittable *object : leaf_objects)
+      {
+        if (object->intersect(r, t_min, t_max, rec))
+        {
+          hit_anything = true;
+          t_max = rec.t;
+        }
+      }
+      return hit_anything;
+    }
+
+    // Visit the child nearer along the split axis first. Its hit shrinks t_max, so the far child's
+    // box test culls it whenever it lies entirely behind that hit.
+    const Hittable *near_child = r.sign[axis] ? right : left;
+    const Hittable *far_child = r.sign[axis] ? left : right;
 
-    return hit_left || hit_right;
+    bool hit_near = near_child->intersect(r, t_min, t_max, rec);
+    bool hit_far = far_child->intersect(r, t_min, hit_near ? rec.t : t_max, rec);
+
+    return hit_near || hit_far;
+  }
+
+  bool occluded(const ray &r, real t_min, real t_max) const override
+  {
+    real box_min = t_min, box_max = t_max;
+    if (!bbox.hit_robust(r, box_min, box_max))
+      return false;
+
+    if (left == nullptr)
+    {
+      for (const Hittable *object : leaf_objects)
+      {
+        if (object->occluded(r, t_min, t_max))
+          return true;
+      }
+      return false;
+    }
+
+    // Any hit will do, so stop at the first child that reports one
+    return left->occluded(r, t_min, t_max) || right->occluded(r, t_min, t_max);
   }
 
   // Return the bounding box of this BVH node
@@ -73,26 +425,34 @@ public:
   {
     delete left;
     delete right;
+    for (Hittable *object : leaf_objects)
+      delete object;
   }
 
 private:
   // Bounding box for this node
   AABB bbox;
+  // Split axis; the left child holds the lower centroids along it
+  int axis = 0;
 
-  // Comparison functions for sorting objects along each axis
-  static bool box_x_compare(const Hittable *a, const Hittable *b)
+  void record_stats(BVHBuildStats &stats, size_t object_span, int depth, const BVHBuildOptions &options,
+                    std::chrono::steady_clock::time_point build_start) const
   {
-    return a->getBoundingBox().min.x < b->getBoundingBox().min.x;
-  }
+    stats.max_depth = std::max(stats.max_depth, depth);
 
-  static bool box_y_compare(const Hittable *a, const Hittable *b)
-  {
-    return a->getBoundingBox().min.y < b->getBoundingBox().min.y;
-  }
+    if (left == nullptr)
+    {
+      stats.leaf_nodes++;
+      stats.leaf_area += bbox.surface_area() * object_span;
+    }
+    else
+    {
+      stats.interior_nodes++;
+      stats.interior_area += bbox.surface_area();
+    }
 
-  static bool box_z_compare(const Hittable *a, const Hittable *b)
-  {
-    return a->getBoundingBox().min.z < b->getBoundingBox().min.z;
+    if (depth == 0)
+      stats.finish(object_span, bbox.surface_area(), options, build_start);
   }
 };
 
@@ -0,0 +1,210 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include "aabb.h"
+#include "bvh.h"
+#include "flat_bvh.h"
+#include "mapped_file.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// Start of an .rtbvh file. The node array and the primitive order follow, each on a 64-byte
+// boundary, in the native byte order and the in-memory LinearBVHNode layout.
+struct BVHCacheHeader
+{
+  char magic[8];       // "RTBVH" and three zero bytes
+  uint32_t version;    // BVHCache::version
+  uint32_t byte_order; // 0x01020304 as the writer stored it
+  uint32_t node_bytes; // sizeof(LinearBVHNode)
+  uint32_t pad;
+  uint64_t key;        // BVHCache::key of the build input
+  uint64_t primitives;
+  uint64_t node_count;
+  uint64_t node_offset;
+  uint64_t order_offset;
+  uint64_t interior_nodes;
+  uint64_t leaf_nodes;
+  int64_t max_depth;
+  double sah_cost;
+  uint64_t payload_hash; // content_hash of everything after the header, to catch damaged files
+};
+
+// Built binary BVHs saved as <dir>/<key>.rtbvh, where the key hashes the primitive bounds and the
+// build options: a tree depends on nothing else, so any later build with the same input, in any
+// scene or mesh, maps the file and copies the finished tree instead of building it again.
+class BVHCache
+{
+public:
+  static constexpr uint32_t version = 1;
+
+  // Cache directory for the renderer: RT_BVH_CACHE if set, "bvh_cache" if not, and empty, so
+  // nothing is cached, for RT_BVH_CACHE=off
+  static std::string default_directory()
+  {
+    const char *setting = std::getenv("RT_BVH_CACHE");
+    if (!setting || !*setting)
+      return "bvh_cache";
+    if (std::strcmp(setting, "off") == 0 || std::strcmp(setting, "0") == 0)
+      return "";
+    return setting;
+  }
+
+  // Hash of everything the built tree depends on. The thread count and the layout width are left
+  // out: every thread count builds the same binary tree, and the wide layouts are collapsed from
+  // it after loading.
+  static uint64_t key(const std::vector<AABB> &prim_bounds, const BVHBuildOptions &options)
+  {
+    std::vector<double> input;
+    input.reserve(6 * prim_bounds.size() + 8);
+    for (const AABB &box : prim_bounds)
+    {
+      for (int a = 0; a < 3; ++a)
+        input.push_back(box.min[a]);
+      for (int a = 0; a < 3; ++a)
+        input.push_back(box.max[a]);
+    }
+    input.push_back(options.method == BVHBuildMethod::lbvh ? 1.0 : 0.0);
+    input.push_back(options.bin_count);
+    input.push_back(options.traversal_cost);
+    input.push_back(options.intersection_cost);
+    input.push_back(options.leaf_cost_threshold);
+    input.push_back(options.max_leaf_size);
+    input.push_back(options.method == BVHBuildMethod::lbvh ? options.treelet_passes : 0);
+    input.push_back(options.method == BVHBuildMethod::lbvh ? options.treelet_size : 0);
+    return MappedFile::content_hash(reinterpret_cast<const char *>(input.data()), input.size() * sizeof(double));
+  }
+
+  static std::string path(const std::string &dir, uint64_t key)
+  {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.rtbvh", static_cast<unsigned long long>(key));
+    return dir + "/" + name;
+  }
+
+  // Load the tree for this key and primitive count into tree. Returns false, leaving the tree
+  // alone, if the file is missing, from another build input or layout, or damaged.
+  static bool load(const std::string &cache_path, uint64_t key, size_t prim_count, FlatBVH &tree,
+                   BVHBuildStats *stats)
+  {
+    MappedFile file(cache_path);
+    if (!file.is_open() || file.size() < sizeof(BVHCacheHeader))
+      return false;
+
+    BVHCacheHeader header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    BVHCacheHeader expected = make_header(key, prim_count, 0, BVHBuildStats());
+    if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != version ||
+        header.byte_order != expected.byte_order || header.node_bytes != expected.node_bytes ||
+        header.key != key || header.primitives != prim_count)
+      return false;
+
+    if (header.node_count == 0 || header.node_count > 2 * prim_count ||
+        !MappedFile::fits(header.node_offset, header.node_count, sizeof(LinearBVHNode), file.size()) ||
+        !MappedFile::fits(header.order_offset, prim_count, sizeof(uint32_t), file.size()))
+      return false;
+
+    if (MappedFile::content_hash(file.data() + sizeof(header), file.size() - sizeof(header)) != header.payload_hash)
+      return false;
+
+    const LinearBVHNode *nodes = reinterpret_cast<const LinearBVHNode *>(file.data() + header.node_offset);
+    const uint32_t *order = reinterpret_cast<const uint32_t *>(file.data() + header.order_offset);
+
+    // Traversal trusts every offset and keeps one stack entry per level, so check the offsets and
+    // the depth before handing the tree out. Children always follow their parent, so one pass in
+    // order sees each node's depth before its children. The header's counts are not covered by
+    // the payload hash, so the stats come from this walk too.
+    std::vector<int> depth(header.node_count, -1);
+    depth[0] = 0;
+    int max_depth = 0;
+    size_t interior_nodes = 0, leaf_nodes = 0;
+    for (size_t i = 0; i < header.node_count; ++i)
+    {
+      const LinearBVHNode &node = nodes[i];
+      if (node.is_leaf() ? node.offset + uint64_t(node.count) > prim_count
+                         : node.offset <= i + 1 || node.offset >= header.node_count)
+        return false;
+      if (depth[i] < 0)
+        continue; // Unreachable from the root, so never traversed
+      if (depth[i] > FlatBVH::max_depth)
+        return false;
+
+      max_depth = std::max(max_depth, depth[i]);
+      if (node.is_leaf())
+      {
+        ++leaf_nodes;
+        continue;
+      }
+      ++interior_nodes;
+      depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+      depth[node.offset] = std::max(depth[node.offset], depth[i] + 1);
+    }
+    for (size_t i = 0; i < prim_count; ++i)
+    {
+      if (order[i] >= prim_count)
+        return false;
+    }
+
+    tree.nodes.assign(nodes, nodes + header.node_count);
+    tree.prim_order.assign(order, order + prim_count);
+    if (stats)
+    {
+      stats->primitives = prim_count;
+      stats->interior_nodes = interior_nodes;
+      stats->leaf_nodes = leaf_nodes;
+      stats->max_depth = max_depth;
+      stats->sah_cost = header.sah_cost;
+    }
+    return true;
+  }
+
+  // Save a freshly built tree, creating the cache directory if needed and replacing any older
+  // file in one rename. Returns false if the directory is not writable.
+  static bool store(const std::string &dir, uint64_t key, const FlatBVH &tree, const BVHBuildStats &stats)
+  {
+    BVHCacheHeader header = make_header(key, tree.prim_order.size(), tree.nodes.size(), stats);
+    std::vector<char> payload;
+    MappedFile::append_at(payload, header.node_offset - sizeof(header), tree.nodes.data(), tree.nodes.size() * sizeof(LinearBVHNode));
+    MappedFile::append_at(payload, header.order_offset - sizeof(header), tree.prim_order.data(), tree.prim_order.size() * sizeof(uint32_t));
+    header.payload_hash = MappedFile::content_hash(payload.data(), payload.size());
+
+#if defined(_WIN32)
+    _mkdir(dir.c_str());
+#else
+    ::mkdir(dir.c_str(), 0755);
+#endif
+    return MappedFile::replace(path(dir, key), &header, sizeof(header), payload);
+  }
+
+private:
+  static BVHCacheHeader make_header(uint64_t key, size_t prim_count, size_t node_count, const BVHBuildStats &stats)
+  {
+    BVHCacheHeader header = BVHCacheHeader();
+    std::memcpy(header.magic, "RTBVH\0\0\0", sizeof(header.magic));
+    header.version = version;
+    header.byte_order = 0x01020304;
+    header.node_bytes = sizeof(LinearBVHNode);
+    header.key = key;
+    header.primitives = prim_count;
+    header.node_count = node_count;
+    header.node_offset = MappedFile::align(sizeof(BVHCacheHeader));
+    header.order_offset = MappedFile::align(header.node_offset + node_count * sizeof(LinearBVHNode));
+    header.interior_nodes = stats.interior_nodes;
+    header.leaf_nodes = stats.leaf_nodes;
+    header.max_depth = stats.max_depth;
+    header.sah_cost = stats.sah_cost;
+    return header;
+  }
+};
+
+#endif // BVH_CACHE_H
@@ -1,6 +1,6 @@
 #include "camera.h"
 
-Camera::Camera(int width, double a_ratio, vec3 center, vec3 look_at, vec3 up, double fov, int samples, int background_color, bvh_node *scene_root)
+Camera::Camera(int width, double a_ratio, vec3 center, vec3 look_at, vec3 up, double fov, int samples, int background_color, Hittable *scene_root)
     : aspect_ratio(a_ratio),
       image_width(width),
       center(center),
@@ -90,9 +90,7 @@ color Camera::ray_color(const ray &r, int depth) const
     return color_from_emission;
   }
 
-  color color_from_scatter;
-  color_from_scatter.value = attenuation.value * ray_color(scattered, depth - 1).value;
-  result.value = color_from_emission.value + color_from_scatter.value;
+  result.value = vec3::mul_add(attenuation.value, ray_color(scattered, depth - 1).value, color_from_emission.value);
   return result.gamma_corrected();
 }
 
@@ -100,11 +98,8 @@ color Camera::ray_color(const ray &r, int depth) const
 ray Camera::get_ray(int i, int j) const
 {
   vec3 offset = sample_square(); // Offset will be a point within a ([-0.5 - 0.5], [-0.5, 0.5]) range
-  vec3 sample, dif_x, dif_y;
-  dif_x = vec3::scale(pixel_delta_u, i + offset.x);
-  dif_y = vec3::scale(pixel_delta_v, j + offset.y);
-  sample = vec3::add(pixel_00_loc, dif_x);
-  sample = vec3::add(sample, dif_y);
+  vec3 sample = vec3::mul_add(pixel_delta_u, i + offset.x, pixel_00_loc);
+  sample = vec3::mul_add(pixel_delta_v, j + offset.y, sample);
 
   Point ray_origin = center;
   vec3 direction = vec3::sub(sample, ray_origin);
@@ -113,84 +108,232 @@ ray Camera::get_ray(int i, int j) const
   return ray(ray_origin, direction, ray_time);
 }
 
-// render iterates across the viewport, getting rays, and their color, then writing that color
-// to the output image.
-void Camera::render() const
+// render splits the viewport into tiles that the threads claim one by one, gets each pixel's rays
+// and their color, then writes the image to the output file. A progressive render repeats this in
+// passes that each add a few samples to every pixel, until a sample, time or error target is met.
+void Camera::render(const RenderOptions &options, RenderStats *stats) const
 {
-  std::vector<std::vector<color>> image(image_height, std::vector<color>(image_width));
-  int thread_count = std::thread::hardware_concurrency();
-  std::vector<std::thread> threads;
-  std::atomic<int> lines_done(0);
-
-  // Progress monitor thread
-  std::thread progress_thread([&]()
-                              {
-    int last_reported = -1;
-    while (lines_done < image_height) {
-      int current = lines_done.load();
-      if (current != last_reported) {
-        std::cout << "Lines completed: " << current << " / " << image_height << "\r" << std::flush;
-        last_reported = current;
+  ThreadPool &pool = ThreadPool::shared();
+  const int thread_count = static_cast<int>(options.threads > 0 ? std::min(options.threads, pool.size()) : pool.size());
+  const int max_samples = options.max_samples > 0 ? options.max_samples : samples_per_pixel;
+  const int pass_samples = !options.progressive() ? max_samples : options.pass_samples > 0 ? options.pass_samples : 4;
+  const int pass_count = (max_samples + pass_samples - 1) / pass_samples;
+
+  std::vector<PixelAccumulator> pixels(static_cast<size_t>(image_width) * image_height);
+  RenderStats totals;
+  totals.busy_ms.assign(thread_count, 0.0);
+  totals.thread_tiles.assign(thread_count, 0);
+  totals.pixels = pixels.size();
+
+  auto render_start = std::chrono::steady_clock::now();
+  auto deadline = std::chrono::steady_clock::time_point::max();
+  if (options.time_budget_s > 0.0)
+    deadline = render_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                  std::chrono::duration<double>(options.time_budget_s));
+  auto last_flush = render_start;
+  std::atomic<int> tiles_done(0);
+
+  if (!options.progressive())
+  {
+    // Progress monitor thread
+    const int tile_count = static_cast<int>(TileScheduler(image_width, image_height, options.tile_size, options.tile_order).size());
+    std::thread progress_thread([&]()
+                                {
+      int last_reported = -1;
+      while (tiles_done < tile_count) {
+        int current = tiles_done.load();
+        if (current != last_reported) {
+          std::cout << "Tiles completed: " << current << " / " << tile_count << "\r" << std::flush;
+          last_reported = current;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50)); 
+      }
+      std::cout << "Tiles completed: " << tile_count << " / " << tile_count << "\n"; });
+
+    render_pass(options, 0, pass_samples, max_samples, pixels, totals, tiles_done, deadline);
+
+    // Wait for progress thread
+    progress_thread.join();
+  }
+  else
+  {
+    for (int pass = 0; pass < pass_count; ++pass)
+    {
+      uint64_t samples_before = totals.samples;
+      render_pass(options, pass, pass_samples, max_samples, pixels, totals, tiles_done, deadline);
+
+      // RMS over the image of the per-pixel standard error
+      double error_sum = 0.0;
+      for (const PixelAccumulator &pixel : pixels)
+        error_sum += pixel.error_squared();
+      totals.error = std::sqrt(error_sum / pixels.size());
+
+      auto now = std::chrono::steady_clock::now();
+      std::chrono::duration<double> elapsed = now - render_start;
+      std::cout << "Pass " << totals.passes << ": " << static_cast<double>(totals.samples) / pixels.size()
+                << " samples per pixel, error estimate " << totals.error << ", " << elapsed.count() << " s\r" << std::flush;
+
+      if (now >= deadline || totals.samples == samples_before ||
+          (options.error_target > 0.0 && totals.error <= options.error_target))
+        break;
+      if (options.flush_interval_s > 0.0 && std::chrono::duration<double>(now - last_flush).count() >= options.flush_interval_s)
+      {
+        write_image(pixels, "output.ppm");
+        last_flush = now;
       }
-      std::this_thread::sleep_for(std::chrono::milliseconds(50)); 
     }
-    std::cout << "Lines completed: " << image_height << " / " << image_height << "\n"; });
+    std::cout << "\n";
+  }
+
+  std::chrono::duration<double, std::milli> render_time = std::chrono::steady_clock::now() - render_start;
+  if (stats)
+  {
+    *stats = totals;
+    stats->render_ms = render_time.count();
+    stats->idle_ms.clear();
+    for (double busy : totals.busy_ms)
+      stats->idle_ms.push_back(std::max(0.0, render_time.count() - busy));
+  }
+
+  if (!write_image(pixels, "output.ppm"))
+  {
+    std::cerr << "Error: could not open output file.\n";
+    return;
+  }
+  std::cerr << "\nDone.\n";
+}
 
-  // Worker threads
-  auto render_rows = [&](int start_row, int end_row)
+// One pass over the frame on the shared pool: every pixel that has neither max_samples nor
+// converged gets up to pass_samples more. Threads stop claiming tiles at the deadline, leaving
+// the rest of the pass undone. Tiles, samples and busy time are added to totals.
+void Camera::render_pass(const RenderOptions &options, int pass, int pass_samples, int max_samples,
+                         std::vector<PixelAccumulator> &pixels, RenderStats &totals, std::atomic<int> &tiles_done,
+                         std::chrono::steady_clock::time_point deadline) const
+{
+  ThreadPool &pool = ThreadPool::shared();
+  const int thread_count = static_cast<int>(totals.busy_ms.size());
+  TileScheduler scheduler(image_width, image_height, options.tile_size, options.tile_order);
+  std::vector<uint64_t> thread_samples(thread_count, 0);
+  std::vector<size_t> thread_tiles(thread_count, 0);
+
+  auto render_tiles = [&](size_t t)
   {
-    for (int j = start_row; j < end_row; ++j)
+    Tile tile;
+    while (std::chrono::steady_clock::now() < deadline && scheduler.next(tile))
     {
-      for (int i = 0; i < image_width; ++i)
+      auto tile_start = std::chrono::steady_clock::now();
+      for (int j = tile.y0; j < tile.y1; ++j)
       {
-        color pixel_color;
-        for (int sample = 0; sample < samples_per_pixel; ++sample)
+        for (int i = tile.x0; i < tile.x1; ++i)
         {
-          ray r = get_ray(i, j);
-          color color_sample = ray_color(r, 50);
-          pixel_color.value = vec3::add(pixel_color.value, color_sample.value);
+          size_t index = static_cast<size_t>(j) * image_width + i;
+          PixelAccumulator &pixel = pixels[index];
+          if (pixel.converged || static_cast<int>(pixel.samples) >= max_samples)
+            continue;
+
+          // Each pixel draws from its own stream in every pass, so the image does not depend on
+          // which thread renders it or when
+          Util::seed(options.seed, 1 + static_cast<uint64_t>(pass) * pixels.size() + index);
+          thread_samples[t] += render_pixel(i, j, options, max_samples, pass_samples, pixel);
         }
-        pixel_color.value = vec3::scale(pixel_color.value, 1.0 / samples_per_pixel);
-        image[j][i] = pixel_color;
       }
-      ++lines_done;
+      std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - tile_start;
+      totals.busy_ms[t] += elapsed.count();
+      ++thread_tiles[t];
+      ++tiles_done;
     }
   };
 
-  int rows_per_thread = image_height / thread_count;
+  // One loop index per thread; each renders tiles until none are left
+  pool.parallel_for(thread_count, thread_count, render_tiles);
+
+  // Count the tiles actually rendered: a time budget can end the pass before the last ones
+  totals.passes++;
   for (int t = 0; t < thread_count; ++t)
   {
-    int start = t * rows_per_thread;
-    int end = (t == thread_count - 1) ? image_height : start + rows_per_thread;
-    threads.emplace_back(render_rows, start, end);
+    totals.thread_tiles[t] += thread_tiles[t];
+    totals.tiles += thread_tiles[t];
+    totals.samples += thread_samples[t];
   }
+}
+
+// Add up to budget camera samples to pixel (i, j), stopping at max_samples, or earlier with
+// adaptive sampling once the pixel has converged. Returns the number of samples taken.
+int Camera::render_pixel(int i, int j, const RenderOptions &options, int max_samples, int budget, PixelAccumulator &pixel) const
+{
+  // Convergence is tested every this many samples. Testing after every sample stops more pixels
+  // on a run of lucky samples that happen to agree.
+  const int test_interval = 8;
 
-  // Join worker threads
-  for (auto &t : threads)
+  const int min_samples = options.noise_threshold > 0.0 ? std::max(2, std::min(options.min_samples, max_samples)) : max_samples;
+  const double threshold_sq = options.noise_threshold * options.noise_threshold;
+
+  // Sum and Welford statistics per channel, carried in double while sampling and stored back as
+  // float. The statistics use values clamped to the displayable range, so a few samples of a
+  // bright light do not keep the pixel going.
+  vec3 sum;
+  double mean[3], m2[3];
+  for (int c = 0; c < 3; ++c)
   {
-    t.join();
+    mean[c] = pixel.mean[c];
+    m2[c] = pixel.m2[c];
   }
 
-  // Wait for progress thread
-  progress_thread.join();
+  int n = static_cast<int>(pixel.samples);
+  const int end = std::min(max_samples, n + budget);
+  while (n < end)
+  {
+    ray r = get_ray(i, j);
+    color color_sample = ray_color(r, 50);
+    sum += color_sample.value;
+    ++n;
 
-  // Write image to file
-  FILE *image_file = fopen("output.ppm", "w");
-  if (!image_file)
+    for (int c = 0; c < 3; ++c)
+    {
+      double v = Util::clamp(0.0, 1.0, color_sample.value[c]);
+      double delta = v - mean[c];
+      mean[c] += delta / n;
+      m2[c] += delta * (v - mean[c]);
+    }
+
+    // The standard error of a channel's mean is sqrt(m2 / (n - 1) / n); stop once the noisiest
+    // channel's is within the threshold
+    if (n >= min_samples && n % test_interval == 0 &&
+        std::max(m2[0], std::max(m2[1], m2[2])) <= threshold_sq * (n - 1) * n)
+    {
+      pixel.converged = true;
+      break;
+    }
+  }
+
+  int taken = n - static_cast<int>(pixel.samples);
+  for (int c = 0; c < 3; ++c)
   {
-    std::cerr << "Error: could not open output file.\n";
-    return;
+    pixel.sum[c] += static_cast<float>(sum[c]);
+    pixel.mean[c] = static_cast<float>(mean[c]);
+    pixel.m2[c] = static_cast<float>(m2[c]);
   }
+  pixel.samples = static_cast<uint32_t>(n);
+  return taken;
+}
+
+// Write the pixel averages as a PPM image. The file is written under a temporary name and renamed
+// over filename, so a viewer watching a progressive render never reads half an image.
+bool Camera::write_image(const std::vector<PixelAccumulator> &pixels, const char *filename) const
+{
+  std::string temp_filename = std::string(filename) + ".tmp";
+  FILE *image_file = fopen(temp_filename.c_str(), "w");
+  if (!image_file)
+    return false;
   fprintf(image_file, "P3\n%d %d\n255\n", image_width, image_height);
-  for (int j = 0; j < image_height; ++j)
+  for (const PixelAccumulator &pixel : pixels)
+    pixel.average().write_to_file(image_file);
+  if (fclose(image_file) != 0 || std::rename(temp_filename.c_str(), filename) != 0)
   {
-    for (int i = 0; i < image_width; ++i)
-    {
-      image[j][i].write_to_file(image_file);
-    }
+    std::remove(temp_filename.c_str());
+    return false;
   }
-  fclose(image_file);
-  std::cerr << "\nDone.\n";
+  return true;
 }
 
 vec3 Camera::sample_square() const
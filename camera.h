@@ -9,24 +9,120 @@
 #include "bvh.h"
 // #include "rtw_stb_image.h"
 #include "material.h"
+#include "thread_pool.h"
+#include "tile_scheduler.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <string>
 #include <vector>
 #include <stdio.h>
 #include <limits>
 #include <thread>
-#include <mutex>
 #include <chrono>
 #include <atomic>
 
 #define MAX_BOUNCES 20
 
+// How render() splits the frame between threads
+struct RenderOptions
+{
+  int tile_size = 16;                        // Side of the square tiles handed to threads, in pixels
+  TileOrder tile_order = TileOrder::hilbert; // Order the tiles are handed out in
+  unsigned threads = 0;                      // Render threads, 0 for every thread of the shared pool
+  uint64_t seed = 0;                         // Job seed; pixel (i, j) samples from its stream 1 + j * width + i
+
+  // Adaptive sampling: with a noise threshold above 0 (0.02 is a good start), a pixel stops once
+  // it has min_samples and the standard error of its mean is at most the threshold in every
+  // channel. Pixels that stay noisy go on up to max_samples, which may be set above the camera's
+  // sample count to spend the samples saved on converged pixels where the noise is.
+  double noise_threshold = 0.0;
+  int min_samples = 32;
+  int max_samples = 0; // 0 for the camera's samples per pixel
+
+  // Progressive rendering: passes over the whole frame, each adding up to pass_samples samples per
+  // pixel to a float accumulation buffer. It stops once every pixel has max_samples (or has
+  // converged), time_budget_s runs out, or the estimated error reaches error_target. Setting any
+  // of these four turns it on; pass_samples defaults to 4 then.
+  int pass_samples = 0;
+  double time_budget_s = 0.0;    // Wall-clock limit on rendering; checked before each tile, 0 for none
+  double error_target = 0.0;     // RMS over the image of each pixel's standard error, 0 for none
+  double flush_interval_s = 0.0; // Rewrite output.ppm after a pass at most this often, 0 for only at the end
+
+  bool progressive() const
+  {
+    return pass_samples > 0 || time_budget_s > 0.0 || error_target > 0.0 || flush_interval_s > 0.0;
+  }
+};
+
+// Samples gathered for one pixel so far: their sum, whose mean is the pixel's color, and the
+// running mean and squared deviations (Welford) of their values clamped to [0, 1], from which
+// adaptive sampling and progressive rendering estimate the noise left
+struct PixelAccumulator
+{
+  float sum[3] = {0.0f, 0.0f, 0.0f};
+  float mean[3] = {0.0f, 0.0f, 0.0f};
+  float m2[3] = {0.0f, 0.0f, 0.0f};
+  uint32_t samples = 0;
+  bool converged = false; // Set by adaptive sampling; no more samples are taken
+
+  color average() const
+  {
+    if (samples == 0)
+      return color();
+    return color(sum[0] / samples, sum[1] / samples, sum[2] / samples);
+  }
+
+  // Squared standard error of the mean in the noisiest channel, infinite below two samples
+  double error_squared() const
+  {
+    if (samples < 2)
+      return std::numeric_limits<double>::infinity();
+    double m2_max = std::max(m2[0], std::max(m2[1], m2[2]));
+    return m2_max / (static_cast<double>(samples - 1) * samples);
+  }
+};
+
+// Where the render threads spent their time, filled in when a stats pointer is handed to render()
+struct RenderStats
+{
+  size_t tiles = 0;
+  double render_ms = 0.0;           // Wall time from starting the threads to the last one finishing
+  std::vector<double> busy_ms;      // Per thread: time spent rendering tiles
+  std::vector<double> idle_ms;      // Per thread: the rest of render_ms, starting up or waiting for the others
+  std::vector<size_t> thread_tiles; // Per thread: tiles rendered
+  size_t pixels = 0;
+  uint64_t samples = 0;             // Camera samples taken over the whole image
+  int passes = 0;                   // Passes over the frame, 1 unless rendering progressively
+  double error = -1.0;              // Final error estimate of a progressive render, -1 otherwise
+
+  void print() const
+  {
+    double busy = 0.0;
+    for (double ms : busy_ms)
+      busy += ms;
+    double utilization = render_ms > 0.0 && !busy_ms.empty() ? busy / (render_ms * busy_ms.size()) : 0.0;
+    std::cout << "Render: " << tiles << " tiles on " << busy_ms.size() << " threads in " << render_ms
+              << " ms, " << 100.0 * utilization << "% busy, "
+              << (pixels > 0 ? static_cast<double>(samples) / pixels : 0.0) << " samples per pixel";
+    if (error >= 0.0)
+      std::cout << ", " << passes << " passes, error estimate " << error;
+    std::cout << std::endl;
+    for (size_t t = 0; t < busy_ms.size(); ++t)
+      std::cout << "  thread " << t << ": " << thread_tiles[t] << " tiles, busy " << busy_ms[t]
+                << " ms, idle " << idle_ms[t] << " ms" << std::endl;
+  }
+};
+
 class Camera
 {
 public:
-  Camera(int width, double a_ratio, vec3 center, vec3 look_at, vec3 up, double fov, int samples, int background_color, bvh_node *scene_root);
+  Camera(int width, double a_ratio, vec3 center, vec3 look_at, vec3 up, double fov, int samples, int background_color, Hittable *scene_root);
 
   color ray_color(const ray &r, int depth = MAX_BOUNCES) const;
   ray get_ray(int i, int j) const;
-  void render() const;
+  void render(const RenderOptions &options = RenderOptions(), RenderStats *stats = nullptr) const;
 
 private:
   double aspect_ratio;
@@ -49,10 +145,15 @@ private:
   vec3 pixel_delta_v;
   int samples_per_pixel; // Number of samples taken for antialiasing
 
-  bvh_node *scene_root; // BVH object for entire scene
+  Hittable *scene_root; // Acceleration structure for entire scene
 
   // Private helper methods
   vec3 sample_square() const;
+  int render_pixel(int i, int j, const RenderOptions &options, int max_samples, int budget, PixelAccumulator &pixel) const;
+  void render_pass(const RenderOptions &options, int pass, int pass_samples, int max_samples,
+                   std::vector<PixelAccumulator> &pixels, RenderStats &totals, std::atomic<int> &tiles_done,
+                   std::chrono::steady_clock::time_point deadline) const;
+  bool write_image(const std::vector<PixelAccumulator> &pixels, const char *filename) const;
 };
 
 #endif // CAMERA_H
\ No newline at end of file
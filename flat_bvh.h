@@ -0,0 +1,461 @@
+#ifndef FLAT_BVH_H
+#define FLAT_BVH_H
+
+#include "aabb.h"
+#include "bvh.h"
+#include "util.h"
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// One node of a flattened BVH. Nodes are stored depth-first, so the first child of an
+// interior node is always the next node in the array and only the second child needs an index.
+// Bounds are stored as floats rounded outward, which keeps the node at 32 bytes (two per cache line).
+// The parts of a ray the node test reads, copied out once per traversal so they stay in
+// registers across the leaf callbacks
+struct NodeRay
+{
+  real origin[3];
+  real inv_direction[3];
+  int sign[3];
+
+  explicit NodeRay(const ray &r)
+  {
+    for (int a = 0; a < 3; ++a)
+    {
+      origin[a] = r.origin[a];
+      inv_direction[a] = r.inv_direction[a];
+      sign[a] = r.sign[a];
+    }
+  }
+};
+
+struct LinearBVHNode
+{
+  static constexpr real far_scale = 1.0 + 2.0 * AABB::gamma(3);
+
+  float bounds_min[3];
+  float bounds_max[3];
+  uint32_t offset; // Leaf: first entry in the primitive order. Interior: index of the second child
+  uint16_t count;  // Number of primitives in a leaf, 0 for interior nodes
+  uint8_t axis;    // Split axis of an interior node
+  uint8_t pad;
+
+  bool is_leaf() const { return count > 0; }
+
+  void set_bounds(const AABB &box)
+  {
+    for (int a = 0; a < 3; ++a)
+    {
+      bounds_min[a] = round_down(box.min[a]);
+      bounds_max[a] = round_up(box.max[a]);
+    }
+  }
+
+  AABB bounds() const
+  {
+    return AABB(vec3(bounds_min[0], bounds_min[1], bounds_min[2]),
+                vec3(bounds_max[0], bounds_max[1], bounds_max[2]));
+  }
+
+  // Slab test against the node box, narrowing [t_min, t_max] to the overlap. Same branchless,
+  // conservative test as AABB::hit_robust, on the float bounds.
+  bool hit(const NodeRay &r, real &t_min, real &t_max) const
+  {
+    for (int axis = 0; axis < 3; ++axis)
+    {
+      const float *near_plane = r.sign[axis] ? bounds_max : bounds_min;
+      const float *far_plane = r.sign[axis] ? bounds_min : bounds_max;
+      real t0 = (near_plane[axis] - r.origin[axis]) * r.inv_direction[axis];
+      real t1 = (far_plane[axis] - r.origin[axis]) * r.inv_direction[axis] * far_scale;
+      t_min = t0 > t_min ? t0 : t_min;
+      t_max = t1 < t_max ? t1 : t_max;
+    }
+    return t_min <= t_max;
+  }
+
+private:
+  static float round_down(double d)
+  {
+    float f = static_cast<float>(d);
+    return f > d ? std::nextafter(f, -INFINITY) : f;
+  }
+
+  static float round_up(double d)
+  {
+    float f = static_cast<float>(d);
+    return f < d ? std::nextafter(f, INFINITY) : f;
+  }
+};
+
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should stay at 32 bytes");
+
+// Flattened BVH over an abstract set of primitives identified by index. The owner keeps the
+// primitives and intersects a leaf's range [offset, offset + count) of prim_order.
+class FlatBVH
+{
+public:
+  std::vector<LinearBVHNode> nodes;
+  std::vector<uint32_t> prim_order; // Primitive indices in leaf order
+
+  // Deepest tree the traversal stack can hold. Past half of it the builder only does median splits,
+  // which bounds the remaining depth by log2 of the primitive count.
+  static const int max_depth = 128;
+
+  // Primitives per subtree task. The top of the tree is split with parallel binning until nodes
+  // reach this size, then each remaining subtree is built whole on one thread. The cut-off does not
+  // depend on the thread count, so every thread count produces the same tree.
+  static size_t subtree_size(size_t prim_count)
+  {
+    return std::max<size_t>(prim_count / 256, 4096);
+  }
+
+  void build(const std::vector<AABB> &prim_bounds, const BVHBuildOptions &options = BVHBuildOptions(), BVHBuildStats *stats = nullptr)
+  {
+    auto build_start = std::chrono::steady_clock::now();
+
+    nodes.clear();
+    prim_order.resize(prim_bounds.size());
+    for (size_t i = 0; i < prim_order.size(); ++i)
+      prim_order[i] = static_cast<uint32_t>(i);
+
+    if (prim_bounds.empty())
+      return;
+
+    unsigned threads = options.threads > 0 ? options.threads : Util::default_threads();
+    BVHBuildStats local_stats;
+
+    // Split the top levels in place and collect the subtrees left over
+    std::vector<TopNode> top;
+    build_top(prim_bounds, 0, prim_order.size(), 0, options, threads, top, local_stats);
+
+    std::vector<uint32_t> tasks;
+    for (uint32_t i = 0; i < top.size(); ++i)
+      if (top[i].is_task())
+        tasks.push_back(i);
+
+    // Biggest subtrees first so a large one does not start last and leave the other threads idle
+    std::stable_sort(tasks.begin(), tasks.end(), [&](uint32_t a, uint32_t b)
+                     { return top[a].end - top[a].start > top[b].end - top[b].start; });
+
+    std::vector<std::vector<LinearBVHNode>> subtrees(top.size());
+    std::vector<BVHBuildStats> subtree_stats(top.size());
+    Util::parallel_for(tasks.size(), threads, [&](size_t k)
+                       {
+      const TopNode &task = top[tasks[k]];
+      subtrees[tasks[k]].reserve(2 * (task.end - task.start));
+      build_recursive(subtrees[tasks[k]], prim_bounds, task.start, task.end, task.depth, options, subtree_stats[tasks[k]]); });
+
+    for (const BVHBuildStats &subtree : subtree_stats)
+      local_stats.merge(subtree);
+
+    // Stitch everything into one depth-first array
+    nodes.reserve(2 * prim_bounds.size());
+    emit(top, 0, subtrees);
+
+    if (stats)
+    {
+      *stats = local_stats;
+      stats->finish(prim_bounds.size(), nodes[0].bounds().surface_area(), options, build_start);
+    }
+  }
+
+  AABB bounds() const
+  {
+    return nodes.empty() ? AABB() : nodes[0].bounds();
+  }
+
+  // Closest-hit traversal with an explicit stack. leaf(first, count, t_max) intersects the
+  // primitives prim_order[first, first + count), returns true on a hit and lowers t_max to it.
+  // The child nearer along the split axis goes first; the other waits on the stack and is culled
+  // by its box test when it lies entirely behind the closest hit found by then.
+  template <typename LeafFn>
+  bool intersect(const ray &r, real t_min, real t_max, LeafFn &&leaf) const
+  {
+    if (nodes.empty())
+      return false;
+
+    const NodeRay nr(r);
+    uint32_t stack[max_depth];
+    int stack_size = 0;
+    uint32_t index = 0;
+    bool hit_anything = false;
+
+    while (true)
+    {
+      const LinearBVHNode &node = nodes[index];
+      real t0 = t_min, t1 = t_max;
+
+      if (node.hit(nr, t0, t1))
+      {
+        if (!node.is_leaf())
+        {
+          // The first child holds the lower centroids, so a ray pointing down the axis starts on the second
+          bool second_first = nr.sign[node.axis];
+          stack[stack_size++] = second_first ? index + 1 : node.offset;
+          index = second_first ? node.offset : index + 1;
+          continue;
+        }
+
+        if (leaf(node.offset, node.count, t_max))
+          hit_anything = true;
+      }
+
+      if (stack_size == 0)
+        break;
+      index = stack[--stack_size];
+    }
+
+    return hit_anything;
+  }
+
+  // Any-hit traversal for occlusion queries. leaf(first, count) returns true if any primitive in
+  // the range blocks the ray; the walk stops there. t_max never shrinks, so order does not matter.
+  template <typename LeafFn>
+  bool intersect_any(const ray &r, real t_min, real t_max, LeafFn &&leaf) const
+  {
+    if (nodes.empty())
+      return false;
+
+    const NodeRay nr(r);
+    uint32_t stack[max_depth];
+    int stack_size = 0;
+    uint32_t index = 0;
+
+    while (true)
+    {
+      const LinearBVHNode &node = nodes[index];
+      real t0 = t_min, t1 = t_max;
+
+      if (node.hit(nr, t0, t1))
+      {
+        if (!node.is_leaf())
+        {
+          stack[stack_size++] = node.offset;
+          index = index + 1;
+          continue;
+        }
+
+        if (leaf(node.offset, node.count))
+          return true;
+      }
+
+      if (stack_size == 0)
+        break;
+      index = stack[--stack_size];
+    }
+
+    return false;
+  }
+
+private:
+  // Node of the top levels of a build. Interior ones point at their two children in the top
+  // array, the rest stand for a subtree that a task builds into its own node array.
+  struct TopNode
+  {
+    AABB box;
+    size_t start, end;
+    int depth;
+    int axis = 0;
+    int left = -1, right = -1;
+
+    bool is_task() const { return left < 0; }
+  };
+
+  int build_top(const std::vector<AABB> &prim_bounds, size_t start, size_t end, int depth,
+                const BVHBuildOptions &options, unsigned threads, std::vector<TopNode> &top, BVHBuildStats &stats)
+  {
+    int index = static_cast<int>(top.size());
+    top.push_back(TopNode());
+    top[index].start = start;
+    top[index].end = end;
+    top[index].depth = depth;
+
+    size_t span = end - start;
+    if (span <= subtree_size(prim_order.size()) || depth >= max_depth / 2)
+      return index;
+
+    // Node and centroid bounds, then SAH bins, each reduced over per-thread chunks
+    size_t chunks = std::min<size_t>(threads, span / 1024 + 1);
+    size_t chunk_size = (span + chunks - 1) / chunks;
+    auto chunk_begin = [&](size_t c)
+    { return start + std::min(span, c * chunk_size); };
+
+    std::vector<AABB> chunk_box(chunks, AABB::empty()), chunk_centroids(chunks, AABB::empty());
+    Util::parallel_for(chunks, threads, [&](size_t c)
+                       {
+      for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); ++i)
+      {
+        const AABB &box = prim_bounds[prim_order[i]];
+        chunk_box[c] = AABB::combine(chunk_box[c], box);
+        chunk_centroids[c].extend(box.centroid());
+      } });
+
+    AABB node_box = AABB::empty(), centroid_box = AABB::empty();
+    for (size_t c = 0; c < chunks; ++c)
+    {
+      node_box = AABB::combine(node_box, chunk_box[c]);
+      centroid_box = AABB::combine(centroid_box, chunk_centroids[c]);
+    }
+    top[index].box = node_box;
+
+    int bin_count = SAHBins::bin_limit(options.bin_count);
+    std::vector<SAHBins> chunk_bins(chunks, SAHBins(bin_count, centroid_box));
+    Util::parallel_for(chunks, threads, [&](size_t c)
+                       {
+      for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); ++i)
+        chunk_bins[c].add(prim_bounds[prim_order[i]]); });
+
+    SAHBins bins(bin_count, centroid_box);
+    for (const SAHBins &chunk : chunk_bins)
+      bins.merge(chunk);
+    BVHSplit split = bins.best_split(node_box, options);
+
+    size_t mid_index;
+    if (split.axis >= 0)
+    {
+      // Stable partition: each chunk counts its left side, then scatters to its offset in a scratch copy
+      auto goes_left = [&](uint32_t prim)
+      { return split.bin_of(prim_bounds[prim].centroid(), bin_count) < split.bin; };
+
+      std::vector<size_t> left_counts(chunks, 0);
+      Util::parallel_for(chunks, threads, [&](size_t c)
+                         {
+        for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); ++i)
+          left_counts[c] += goes_left(prim_order[i]); });
+
+      size_t left_total = 0;
+      for (size_t c = 0; c < chunks; ++c)
+        left_total += left_counts[c];
+
+      std::vector<uint32_t> scratch(span);
+      Util::parallel_for(chunks, threads, [&](size_t c)
+                         {
+        size_t left_out = 0, right_out = left_total;
+        for (size_t k = 0; k < c; ++k)
+        {
+          left_out += left_counts[k];
+          right_out += (chunk_begin(k + 1) - chunk_begin(k)) - left_counts[k];
+        }
+        for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); ++i)
+        {
+          uint32_t prim = prim_order[i];
+          scratch[goes_left(prim) ? left_out++ : right_out++] = prim;
+        } });
+
+      std::copy(scratch.begin(), scratch.end(), prim_order.begin() + start);
+      mid_index = start + left_total;
+      top[index].axis = split.axis;
+    }
+    else
+    {
+      auto bounds_of = [&](uint32_t prim)
+      { return prim_bounds[prim]; };
+      mid_index = BVHBuilder::median_split(prim_order.data() + start, prim_order.data() + end, bounds_of, &top[index].axis) - prim_order.data();
+    }
+
+    stats.interior_nodes++;
+    stats.interior_area += node_box.surface_area();
+    stats.max_depth = std::max(stats.max_depth, depth);
+
+    int left = build_top(prim_bounds, start, mid_index, depth + 1, options, threads, top, stats);
+    int right = build_top(prim_bounds, mid_index, end, depth + 1, options, threads, top, stats);
+    top[index].left = left;
+    top[index].right = right;
+    return index;
+  }
+
+  // Append top node `index` and everything below it to nodes in depth-first order
+  uint32_t emit(const std::vector<TopNode> &top, int index, const std::vector<std::vector<LinearBVHNode>> &subtrees)
+  {
+    const TopNode &t = top[index];
+    uint32_t node_index = static_cast<uint32_t>(nodes.size());
+
+    if (t.is_task())
+    {
+      // Subtree nodes were numbered from zero; rebase the second-child links
+      for (LinearBVHNode node : subtrees[index])
+      {
+        if (!node.is_leaf())
+          node.offset += node_index;
+        nodes.push_back(node);
+      }
+      return node_index;
+    }
+
+    nodes.push_back(LinearBVHNode());
+    nodes[node_index].set_bounds(t.box);
+    nodes[node_index].axis = static_cast<uint8_t>(t.axis);
+    nodes[node_index].count = 0;
+    emit(top, t.left, subtrees);
+    uint32_t second = emit(top, t.right, subtrees);
+    nodes[node_index].offset = second;
+    return node_index;
+  }
+
+  uint32_t build_recursive(std::vector<LinearBVHNode> &out, const std::vector<AABB> &prim_bounds, size_t start, size_t end, int depth,
+                           const BVHBuildOptions &options, BVHBuildStats &stats)
+  {
+    auto bounds_of = [&](uint32_t prim)
+    { return prim_bounds[prim]; };
+
+    AABB node_box = AABB::empty();
+    for (size_t i = start; i < end; ++i)
+      node_box = AABB::combine(node_box, prim_bounds[prim_order[i]]);
+
+    uint32_t node_index = static_cast<uint32_t>(out.size());
+    out.push_back(LinearBVHNode());
+    out[node_index].set_bounds(node_box);
+    stats.max_depth = std::max(stats.max_depth, depth);
+
+    size_t span = end - start;
+    uint32_t *first = prim_order.data() + start;
+    uint32_t *last = prim_order.data() + end;
+    uint32_t *mid = nullptr;
+    int axis = 0;
+
+    if (!BVHBuilder::leaf_without_split(span, options))
+    {
+      BVHSplit split;
+      if (depth < max_depth / 2 && !BVHBuilder::small_node(span, options))
+        split = BVHBuilder::find_sah_split(first, last, node_box, bounds_of, options);
+
+      if (!BVHBuilder::keep_as_leaf(span, split, options))
+      {
+        if (split.axis >= 0)
+        {
+          mid = BVHBuilder::partition(first, last, split, bounds_of, options);
+          axis = split.axis;
+        }
+        else
+        {
+          mid = BVHBuilder::median_split(first, last, bounds_of, &axis);
+        }
+      }
+    }
+
+    if (mid == nullptr)
+    {
+      out[node_index].offset = static_cast<uint32_t>(start);
+      out[node_index].count = static_cast<uint16_t>(span);
+      stats.leaf_nodes++;
+      stats.leaf_area += node_box.surface_area() * span;
+      return node_index;
+    }
+
+    size_t mid_index = mid - prim_order.data();
+    stats.interior_nodes++;
+    stats.interior_area += node_box.surface_area();
+
+    build_recursive(out, prim_bounds, start, mid_index, depth + 1, options, stats);
+    uint32_t second = build_recursive(out, prim_bounds, mid_index, end, depth + 1, options, stats);
+
+    out[node_index].offset = second;
+    out[node_index].count = 0;
+    out[node_index].axis = static_cast<uint8_t>(axis);
+    return node_index;
+  }
+};
+
+#endif // FLAT_BVH_H
\ No newline at end of file
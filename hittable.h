@@ -4,6 +4,7 @@
 #include "ray.h"
 #include "color.h"
 #include "aabb.h"
+#include <cstdint>
 // #include "material.h"
 
 class Hittable;
@@ -14,11 +15,14 @@ class hit_record
 public:
     vec3 p;          // Point of intersection
     vec3 normal;     // Normal at the intersection point
-    double t;        // Distance along the ray where the hit occurs
+    real t;          // Distance along the ray where the hit occurs
     bool front_face; // bool indicating if hit the front face
-    double u;        // u and v are texture coordinates
-    double v;
+    real u;          // u and v are texture coordinates
+    real v;
     material *mat; // copy of material the ray hit
+    const Hittable *object = nullptr; // Object whose finalize_hit() shades this hit
+    uint32_t primitive = 0;           // Primitive within that object, e.g. a mesh triangle
+    const Hittable *inner = nullptr;  // For an Instance hit, the object inside it that recorded the hit
 
     // double reflectivity;
 
@@ -26,13 +30,13 @@ public:
     hit_record() : t(INFINITY) {}
 
     // Constructor with all the necessary details
-    hit_record(const vec3 &p, const vec3 &normal, double t, material *mat)
+    hit_record(const vec3 &p, const vec3 &normal, real t, material *mat)
         : p(p), normal(normal), t(t), mat(mat) {}
 
     void set_face_normal(const ray &r, const vec3 &outward_normal)
     {
         front_face = vec3::dot(r.direction, outward_normal) < 0;
-        normal = front_face ? outward_normal : (outward_normal * -1.0);
+        normal = front_face ? outward_normal : -outward_normal;
     }
 };
 
@@ -46,8 +50,33 @@ public:
 
     virtual ~Hittable() = default; // Virtual destructor for cleanup
 
-    // Pure virtual method that will be implemented by derived classes
-    virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const = 0;
+    // Closest hit within [t_min, t_max] with the hit record fully filled in
+    virtual bool hit(const ray &r, real t_min, real t_max, hit_record &rec) const
+    {
+        if (!intersect(r, t_min, t_max, rec))
+            return false;
+        rec.object->finalize_hit(r, rec);
+        return true;
+    }
+
+    // Traversal half of hit(): finds the closest hit but records only rec.t, the object that
+    // owns it (rec.object and rec.primitive) and any surface parameters the test computed anyway.
+    // Aggregates call it on their children, so the hit point, normal and texture coordinates are
+    // worked out once for the final winner instead of for every closer candidate.
+    virtual bool intersect(const ray &r, real t_min, real t_max, hit_record &rec) const = 0;
+
+    // Shading half of hit(): fills in p, normal, front_face, u, v and mat for a hit that this
+    // object's intersect() recorded
+    virtual void finalize_hit(const ray &, hit_record &) const {}
+
+    // Any-hit query for shadow and visibility rays: true as soon as anything blocks the ray
+    // within [t_min, t_max]. Overrides return at the first hit and never fill a hit_record;
+    // this fallback just runs the closest-hit test.
+    virtual bool occluded(const ray &r, real t_min, real t_max) const
+    {
+        hit_record rec;
+        return intersect(r, t_min, t_max, rec);
+    }
 
     // Pure virtual method to get the bounding box of the object
     virtual AABB getBoundingBox() const = 0;
@@ -5,6 +5,7 @@
 #include "triangle.h"
 #include "sphere.h"
 #include "bvh.h"
+#include "linear_bvh.h"
 #include <vector>
 #include <iostream>
 #include <stdio.h>
@@ -18,7 +19,7 @@ public:
   std::vector<Hittable *> objects;
   material *mat;
   AABB bbox;
-  bvh_node *local_bvh = nullptr;
+  linear_bvh *local_bvh = nullptr;
 
   // Constructor that initializes the list with reflectivity
   // HittableList(double reflectivity = 0.0) : Hittable(reflectivity) {}
@@ -29,14 +30,23 @@ public:
     objects.push_back(object);
   }
 
-  // Override the hit() method to check intersection with all objects in the list
-  bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override
+  // Check intersection with all objects in the list
+  bool intersect(const ray &r, real t_min, real t_max, hit_record &rec) const override
   {
-    if (!getBoundingBox().hit(r, t_min, t_max))
+    real box_min = t_min, box_max = t_max;
+    if (!getBoundingBox().hit_robust(r, box_min, box_max))
     {
       return false; // Early exit if ray misses the overall AABB
     }
-    return local_bvh && local_bvh->hit(r, t_min, t_max, rec);
+    return local_bvh && local_bvh->intersect(r, t_min, t_max, rec);
+  }
+
+  bool occluded(const ray &r, real t_min, real t_max) const override
+  {
+    real box_min = t_min, box_max = t_max;
+    if (!getBoundingBox().hit_robust(r, box_min, box_max))
+      return false;
+    return local_bvh && local_bvh->occluded(r, t_min, t_max);
   }
 
   void
@@ -61,73 +71,12 @@ public:
     return bbox;
   }
 
-  static HittableList load_triangles_from_obj(const std::string &filename, material *mat)
+  // Build the BVH over the objects added so far. Triangle meshes loaded from OBJ files are
+  // TriangleMesh objects with a BVH of their own.
+  void build_bvh(const BVHBuildOptions &bvh_options = BVHBuildOptions())
   {
-    std::ifstream file(filename);
-    if (!file.is_open())
-    {
-      throw std::runtime_error("Could not open OBJ file");
-    }
-
-    std::vector<vec3> vertices; // Store the vertices (points)
-    HittableList triangle_list; // HittableList to store the triangles
-
-    triangle_list.mat = mat;
-
-    std::string line;
-    while (std::getline(file, line))
-    {
-      std::istringstream iss(line);
-      std::string prefix;
-
-      // Read the type of line (v for vertex, f for face)
-      iss >> prefix;
-
-      // Process vertex lines (v x y z)
-      if (prefix == "v")
-      {
-        double x, y, z;
-        iss >> x >> y >> z;
-        vertices.push_back(vec3(x, y, z));
-      }
-      // Process face lines (f v1 v2 v3)
-      else if (prefix == "f")
-      {
-        int v1, v2, v3;
-
-        // Check if the face line has 3 vertex indices
-        if (iss >> v1 >> v2 >> v3)
-        {
-          // OBJ format face indices are 1-based, so subtract 1 to make them 0-based
-          v1--;
-          v2--;
-          v3--;
-
-          // Ensure the vertex indices are valid
-          if (v1 >= 0 && v2 >= 0 && v3 >= 0 && v1 < vertices.size() && v2 < vertices.size() && v3 < vertices.size())
-          {
-            // Add triangle to the HittableList
-            // std::cout << reflectivity << std::endl;
-            triangle_list.add(new Triangle(vertices[v1], vertices[v2], vertices[v3], mat));
-          }
-          else
-          {
-            std::cerr << "Invalid vertex indices for face: " << v1 + 1 << ", " << v2 + 1 << ", " << v3 + 1 << std::endl;
-          }
-        }
-        else
-        {
-          std::cerr << "Error parsing face line: " << line << std::endl;
-        }
-      }
-    }
-
-    file.close();
-
-    triangle_list.computeBoundingBox();
-    triangle_list.local_bvh = new bvh_node(triangle_list.objects.data(), 0, triangle_list.objects.size());
-
-    return triangle_list; // Return the populated HittableList
+    computeBoundingBox();
+    local_bvh = new linear_bvh(objects, bvh_options);
   }
 };
 
@@ -0,0 +1,68 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "hittable.h"
+#include "transform.h"
+
+// A placement of a shared object, usually a mesh with its own BVH, in the scene. The scene BVH
+// holds instances as its leaves and each instance moves the ray into object space, so any number
+// of copies cost one transform each instead of a full set of triangles and a BVH apiece.
+class Instance : public Hittable
+{
+public:
+  const Hittable *object; // Shared, not owned
+  Transform object_to_world;
+  Transform world_to_object;
+  material *mat; // Replaces the object's own material when set
+
+  Instance(const Hittable *object, const Transform &object_to_world, material *mat = nullptr)
+      : object(object), object_to_world(object_to_world), world_to_object(object_to_world.inverse()), mat(mat)
+  {
+    bbox = object_to_world.box(object->getBoundingBox());
+    bounding_box = bbox;
+  }
+
+  // Records the hit of the object inside as this instance's, keeping the inner object in
+  // rec.inner, so a nearer instance found later costs the losers no shading at all
+  bool intersect(const ray &r, real t_min, real t_max, hit_record &rec) const override
+  {
+    // The direction is transformed but not renormalized, so t is the same on both sides
+    const ray local = world_to_object.apply(r);
+    if (!object->intersect(local, t_min, t_max, rec))
+      return false;
+
+    // rec.inner has room for one level, so an instance of an instance is shaded right away
+    if (dynamic_cast<const Instance *>(rec.object))
+    {
+      rec.object->finalize_hit(local, rec);
+      rec.inner = nullptr;
+    }
+    else
+      rec.inner = rec.object;
+    rec.object = this;
+    return true;
+  }
+
+  // Shade the hit in object space with the inner object, then move the point and normal out
+  void finalize_hit(const ray &r, hit_record &rec) const override
+  {
+    if (rec.inner)
+      rec.inner->finalize_hit(world_to_object.apply(r), rec);
+    rec.p = r.at(rec.t);
+    rec.normal = vec3::unit_vector(world_to_object.transpose_vector(rec.normal));
+    if (mat)
+      rec.mat = mat;
+  }
+
+  bool occluded(const ray &r, real t_min, real t_max) const override
+  {
+    return object->occluded(world_to_object.apply(r), t_min, t_max);
+  }
+
+  AABB getBoundingBox() const override { return bbox; }
+
+private:
+  AABB bbox;
+};
+
+#endif // INSTANCE_H
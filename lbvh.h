@@ -0,0 +1,535 @@
+#ifndef LBVH_H
+#define LBVH_H
+
+#include "aabb.h"
+#include "bvh.h"
+#include "flat_bvh.h"
+#include "util.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Fast BVH builder for previews and animation frames. Primitive centroids are quantized onto a
+// Morton (Z-order) curve, radix sorted in parallel, and the hierarchy falls out of the sorted
+// codes in linear time: every node splits where the codes first differ. The tree can then be
+// improved with a few rounds of treelet restructuring (Karras and Aila 2013), which re-solves
+// small groups of nodes for the optimal SAH topology.
+class LBVHBuilder
+{
+public:
+  static void build(FlatBVH &tree, const std::vector<AABB> &prim_bounds, const BVHBuildOptions &options = BVHBuildOptions(),
+                    BVHBuildStats *stats = nullptr)
+  {
+    auto build_start = std::chrono::steady_clock::now();
+
+    tree.nodes.clear();
+    tree.prim_order.clear();
+    if (prim_bounds.empty())
+      return;
+
+    LBVHBuilder builder(prim_bounds, options);
+    builder.sort_primitives();
+    builder.build_hierarchy();
+    for (int pass = 0; pass < options.treelet_passes; ++pass)
+      builder.optimize_treelets();
+
+    BVHBuildStats local_stats;
+    tree.nodes.reserve(builder.nodes.size());
+    tree.prim_order.reserve(prim_bounds.size());
+    builder.emit(tree, builder.root, 0, local_stats);
+
+    if (stats)
+    {
+      *stats = local_stats;
+      stats->finish(prim_bounds.size(), tree.nodes[0].bounds().surface_area(), options, build_start);
+    }
+  }
+
+private:
+  // Sort key of one primitive. Equal codes keep their input order, since the sort is stable.
+  struct MortonPrim
+  {
+    uint64_t code;
+    uint32_t prim;
+  };
+
+  // Node of the intermediate tree. Leaves hold the single primitive sorted[start]; interior nodes
+  // keep the primitive count and SAH cost of their subtree for the treelet pass and for
+  // collapsing small subtrees into leaves on output.
+  struct Node
+  {
+    AABB box;
+    int left = -1, right = -1;
+    uint32_t start = 0;
+    uint32_t count = 0;
+    int height = 0;
+    double cost = 0.0;
+
+    bool is_leaf() const { return left < 0; }
+  };
+
+  static const int max_treelet = 8;
+
+  const std::vector<AABB> &prim_bounds;
+  const BVHBuildOptions &options;
+  unsigned threads;
+  int code_bits = 30;
+  std::vector<MortonPrim> sorted;
+  std::vector<Node> nodes;
+  int root = -1;
+
+  LBVHBuilder(const std::vector<AABB> &prim_bounds, const BVHBuildOptions &options)
+      : prim_bounds(prim_bounds), options(options),
+        threads(options.threads > 0 ? options.threads : Util::default_threads())
+  {
+    // 10 bits per axis separate a million primitives on an even grid; past that use 21
+    code_bits = prim_bounds.size() > (size_t(1) << 20) ? 63 : 30;
+  }
+
+  // Runs fn(chunk, begin, end) over chunks of [0, count) on the build threads
+  template <typename ChunkFn>
+  void for_chunks(size_t count, size_t chunks, ChunkFn fn) const
+  {
+    size_t chunk_size = (count + chunks - 1) / chunks;
+    Util::parallel_for(chunks, threads, [&](size_t c)
+                       { fn(c, std::min(count, c * chunk_size), std::min(count, (c + 1) * chunk_size)); });
+  }
+
+  size_t chunk_count(size_t count) const
+  {
+    return std::min<size_t>(threads, count / 4096 + 1);
+  }
+
+  // Spread the low bits of v so there are two zero bits between each: 10 bits for 30-bit codes,
+  // 21 bits for 63-bit codes
+  static uint64_t expand_bits_10(uint64_t v)
+  {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x30000ff;
+    v = (v | (v << 8)) & 0x300f00f;
+    v = (v | (v << 4)) & 0x30c30c3;
+    v = (v | (v << 2)) & 0x9249249;
+    return v;
+  }
+
+  static uint64_t expand_bits_21(uint64_t v)
+  {
+    v &= 0x1fffff;
+    v = (v | (v << 32)) & 0x1f00000000ffffULL;
+    v = (v | (v << 16)) & 0x1f0000ff0000ffULL;
+    v = (v | (v << 8)) & 0x100f00f00f00f00fULL;
+    v = (v | (v << 4)) & 0x10c30c30c30c30c3ULL;
+    v = (v | (v << 2)) & 0x1249249249249249ULL;
+    return v;
+  }
+
+  uint64_t morton_code(const vec3 &p, const AABB &centroid_box) const
+  {
+    int axis_bits = code_bits / 3;
+    double cells = static_cast<double>(uint64_t(1) << axis_bits);
+    uint64_t q[3];
+    for (int a = 0; a < 3; ++a)
+    {
+      double extent = centroid_box.max[a] - centroid_box.min[a];
+      double u = extent > 0.0 ? (p[a] - centroid_box.min[a]) / extent : 0.0;
+      q[a] = static_cast<uint64_t>(std::min(std::max(u * cells, 0.0), cells - 1.0));
+    }
+    if (code_bits == 30)
+      return (expand_bits_10(q[0]) << 2) | (expand_bits_10(q[1]) << 1) | expand_bits_10(q[2]);
+    return (expand_bits_21(q[0]) << 2) | (expand_bits_21(q[1]) << 1) | expand_bits_21(q[2]);
+  }
+
+  void sort_primitives()
+  {
+    size_t n = prim_bounds.size();
+    size_t chunks = chunk_count(n);
+
+    std::vector<AABB> chunk_centroids(chunks, AABB::empty());
+    for_chunks(n, chunks, [&](size_t c, size_t begin, size_t end)
+               {
+      for (size_t i = begin; i < end; ++i)
+        chunk_centroids[c].extend(prim_bounds[i].centroid()); });
+
+    AABB centroid_box = AABB::empty();
+    for (const AABB &box : chunk_centroids)
+      centroid_box = AABB::combine(centroid_box, box);
+
+    sorted.resize(n);
+    for_chunks(n, chunks, [&](size_t, size_t begin, size_t end)
+               {
+      for (size_t i = begin; i < end; ++i)
+        sorted[i] = {morton_code(prim_bounds[i].centroid(), centroid_box), static_cast<uint32_t>(i)}; });
+
+    radix_sort();
+  }
+
+  // Least-significant-digit radix sort on 8-bit digits. Each pass histograms the chunks in
+  // parallel, turns the histograms into per-chunk output offsets, and scatters each chunk in
+  // order, so the sort is stable and independent of the thread count.
+  void radix_sort()
+  {
+    const int digit_bits = 8;
+    const size_t radix = size_t(1) << digit_bits;
+    size_t n = sorted.size();
+    size_t chunks = chunk_count(n);
+
+    std::vector<MortonPrim> scratch(n);
+    std::vector<size_t> offsets(chunks * radix);
+
+    for (int shift = 0; shift < code_bits; shift += digit_bits)
+    {
+      std::fill(offsets.begin(), offsets.end(), 0);
+      for_chunks(n, chunks, [&](size_t c, size_t begin, size_t end)
+                 {
+        size_t *histogram = &offsets[c * radix];
+        for (size_t i = begin; i < end; ++i)
+          histogram[(sorted[i].code >> shift) & (radix - 1)]++; });
+
+      // Digit-major prefix sum: all of digit 0 across chunks, then digit 1, and so on
+      size_t total = 0;
+      for (size_t digit = 0; digit < radix; ++digit)
+      {
+        for (size_t c = 0; c < chunks; ++c)
+        {
+          size_t count = offsets[c * radix + digit];
+          offsets[c * radix + digit] = total;
+          total += count;
+        }
+      }
+
+      for_chunks(n, chunks, [&](size_t c, size_t begin, size_t end)
+                 {
+        size_t *next = &offsets[c * radix];
+        for (size_t i = begin; i < end; ++i)
+          scratch[next[(sorted[i].code >> shift) & (radix - 1)]++] = sorted[i]; });
+
+      sorted.swap(scratch);
+    }
+  }
+
+  // Length of the common prefix of the keys at sorted positions i and i + 1. Duplicate codes
+  // fall back to comparing the positions, so every key is distinct.
+  int common_prefix(size_t i) const
+  {
+    uint64_t diff = sorted[i].code ^ sorted[i + 1].code;
+    if (diff != 0)
+      return __builtin_clzll(diff);
+    uint32_t index_diff = static_cast<uint32_t>(i) ^ static_cast<uint32_t>(i + 1);
+    return 64 + __builtin_clz(index_diff);
+  }
+
+  // The split between sorted primitives i and i + 1 belongs to the node whose range is the
+  // longest one sharing that prefix, so the splits form a Cartesian tree over the prefix lengths
+  // (shorter prefix = higher in the tree). One stack pass builds it in linear time.
+  void build_hierarchy()
+  {
+    size_t n = sorted.size();
+    nodes.clear();
+    nodes.reserve(2 * n);
+    if (n == 1)
+    {
+      root = make_leaf(0, 1);
+      return;
+    }
+
+    size_t splits = n - 1;
+    std::vector<int> prefix(splits);
+    for_chunks(splits, chunk_count(splits), [&](size_t, size_t begin, size_t end)
+               {
+      for (size_t i = begin; i < end; ++i)
+        prefix[i] = common_prefix(i); });
+
+    std::vector<int> left(splits, -1), right(splits, -1), stack;
+    stack.reserve(128);
+    for (size_t i = 0; i < splits; ++i)
+    {
+      int last = -1;
+      while (!stack.empty() && prefix[stack.back()] > prefix[i])
+      {
+        last = stack.back();
+        stack.pop_back();
+      }
+      left[i] = last;
+      if (!stack.empty())
+        right[stack.back()] = static_cast<int>(i);
+      stack.push_back(static_cast<int>(i));
+    }
+
+    // Prefix lengths strictly grow going down, so the recursion is at most 96 deep
+    root = make_subtree(stack.front(), 0, n - 1, left, right);
+  }
+
+  // Node over sorted[first, last] whose top split is `split`
+  int make_subtree(int split, size_t first, size_t last, const std::vector<int> &left, const std::vector<int> &right)
+  {
+    if (first == last)
+      return make_leaf(first, 1);
+
+    size_t s = static_cast<size_t>(split);
+    int left_child = make_subtree(left[s], first, s, left, right);
+    int right_child = make_subtree(right[s], s + 1, last, left, right);
+
+    int index = static_cast<int>(nodes.size());
+    nodes.push_back(Node());
+    nodes[index].left = left_child;
+    nodes[index].right = right_child;
+    refit(index);
+    return index;
+  }
+
+  int make_leaf(size_t start, size_t count)
+  {
+    int index = static_cast<int>(nodes.size());
+    nodes.push_back(Node());
+    Node &leaf = nodes[index];
+    leaf.box = AABB::empty();
+    for (size_t i = start; i < start + count; ++i)
+      leaf.box = AABB::combine(leaf.box, prim_bounds[sorted[i].prim]);
+    leaf.start = static_cast<uint32_t>(start);
+    leaf.count = static_cast<uint32_t>(count);
+    leaf.cost = options.intersection_cost * leaf.box.surface_area() * count;
+    return index;
+  }
+
+  void refit(int index)
+  {
+    Node &node = nodes[index];
+    const Node &l = nodes[node.left];
+    const Node &r = nodes[node.right];
+    node.box = AABB::combine(l.box, r.box);
+    node.count = l.count + r.count;
+    node.height = std::max(l.height, r.height) + 1;
+    node.cost = options.traversal_cost * node.box.surface_area() + l.cost + r.cost;
+  }
+
+  // One bottom-up treelet pass. Subtrees below the same cut-off the SAH builder uses are
+  // restructured in parallel, then the nodes above them serially.
+  void optimize_treelets()
+  {
+    if (nodes[root].is_leaf())
+      return;
+
+    size_t cutoff = FlatBVH::subtree_size(sorted.size());
+    std::vector<int> subtrees, top;
+    collect_subtrees(root, cutoff, subtrees, top);
+
+    Util::parallel_for(subtrees.size(), threads, [&](size_t k)
+                       { optimize_subtree(subtrees[k]); });
+
+    // Collected parents-first, so walking backwards visits children before parents
+    for (auto it = top.rbegin(); it != top.rend(); ++it)
+    {
+      restructure(*it);
+      refit(*it);
+    }
+  }
+
+  void collect_subtrees(int index, size_t cutoff, std::vector<int> &subtrees, std::vector<int> &top) const
+  {
+    const Node &node = nodes[index];
+    if (node.is_leaf())
+      return;
+    if (node.count <= cutoff)
+    {
+      subtrees.push_back(index);
+      return;
+    }
+    top.push_back(index);
+    collect_subtrees(node.left, cutoff, subtrees, top);
+    collect_subtrees(node.right, cutoff, subtrees, top);
+  }
+
+  void optimize_subtree(int index)
+  {
+    Node &node = nodes[index];
+    if (node.is_leaf())
+      return;
+    optimize_subtree(node.left);
+    optimize_subtree(node.right);
+    restructure(index);
+    refit(index);
+  }
+
+  // Grow a treelet under `index` by repeatedly opening its largest interior leaf, then rebuild
+  // it with the topology of least SAH cost found by dynamic programming over leaf subsets.
+  void restructure(int index)
+  {
+    int size = std::min(std::max(options.treelet_size, 3), int(max_treelet));
+
+    int leaves[max_treelet];
+    int interiors[max_treelet];
+    int leaf_count = 0, interior_count = 0;
+    leaves[leaf_count++] = nodes[index].left;
+    leaves[leaf_count++] = nodes[index].right;
+    interiors[interior_count++] = index;
+
+    while (leaf_count < size)
+    {
+      int best = -1;
+      double best_area = -1.0;
+      for (int i = 0; i < leaf_count; ++i)
+      {
+        const Node &candidate = nodes[leaves[i]];
+        if (!candidate.is_leaf() && candidate.box.surface_area() > best_area)
+        {
+          best_area = candidate.box.surface_area();
+          best = i;
+        }
+      }
+      if (best < 0)
+        break;
+
+      int opened = leaves[best];
+      interiors[interior_count++] = opened;
+      leaves[best] = nodes[opened].left;
+      leaves[leaf_count++] = nodes[opened].right;
+    }
+    if (leaf_count < 3)
+      return;
+
+    // cost[s]: cheapest subtree over leaf subset s; split[s]: the left half that achieves it
+    const int subsets = 1 << leaf_count;
+    AABB box[1 << max_treelet];
+    double cost[1 << max_treelet];
+    int height[1 << max_treelet];
+    int split[1 << max_treelet];
+
+    for (int s = 1; s < subsets; ++s)
+    {
+      int low = s & -s;
+      if (s == low)
+      {
+        const Node &leaf = nodes[leaves[__builtin_ctz(s)]];
+        box[s] = leaf.box;
+        cost[s] = leaf.cost;
+        height[s] = leaf.height;
+        continue;
+      }
+
+      box[s] = AABB::combine(box[s ^ low], box[low]);
+
+      // Halves containing the lowest leaf, so each partition is tried once
+      double best = std::numeric_limits<double>::infinity();
+      int best_split = 0;
+      int rest = s ^ low;
+      for (int p = (rest - 1) & rest;; p = (p - 1) & rest)
+      {
+        int half = p | low;
+        double c = cost[half] + cost[s ^ half];
+        if (c < best)
+        {
+          best = c;
+          best_split = half;
+        }
+        if (p == 0)
+          break;
+      }
+      cost[s] = options.traversal_cost * box[s].surface_area() + best;
+      split[s] = best_split;
+      height[s] = std::max(height[best_split], height[s ^ best_split]) + 1;
+    }
+
+    // Keep the old treelet unless the new one is cheaper. A new one may not deepen the tree past
+    // half the traversal stack, so the finished tree always fits FlatBVH::max_depth.
+    int full = subsets - 1;
+    const Node &current = nodes[index];
+    if (cost[full] >= current.cost * (1.0 - 1e-9))
+      return;
+    if (height[full] > std::max(current.height, FlatBVH::max_depth / 2))
+      return;
+
+    int next_interior = 1;
+    rebuild(index, full, leaves, interiors, next_interior, split);
+  }
+
+  void rebuild(int index, int subset, const int *leaves, const int *interiors, int &next_interior, const int *split)
+  {
+    int halves[2] = {split[subset], subset ^ split[subset]};
+    int children[2];
+    for (int side = 0; side < 2; ++side)
+    {
+      int half = halves[side];
+      if ((half & (half - 1)) == 0)
+      {
+        children[side] = leaves[__builtin_ctz(half)];
+        continue;
+      }
+      children[side] = interiors[next_interior++];
+      rebuild(children[side], half, leaves, interiors, next_interior, split);
+    }
+
+    nodes[index].left = children[0];
+    nodes[index].right = children[1];
+    refit(index);
+  }
+
+  // Subtrees that fit in a leaf are emitted as one when that is no more expensive under the SAH,
+  // or when they are below the leaf cost threshold
+  bool emit_as_leaf(const Node &node) const
+  {
+    if (node.is_leaf())
+      return true;
+    if (node.count > BVHBuilder::max_leaf_size(options))
+      return false;
+    return BVHBuilder::small_node(node.count, options) ||
+           options.intersection_cost * node.box.surface_area() * node.count <= node.cost;
+  }
+
+  // Primitives under `index` in depth-first order
+  void gather(int index, std::vector<uint32_t> &prim_order) const
+  {
+    const Node &node = nodes[index];
+    if (node.is_leaf())
+    {
+      prim_order.push_back(sorted[node.start].prim);
+      return;
+    }
+    gather(node.left, prim_order);
+    gather(node.right, prim_order);
+  }
+
+  // Write the tree depth-first into the FlatBVH. Treelet restructuring can leave a subtree's
+  // primitives scattered over the sorted order, so leaves take their primitives in output order.
+  uint32_t emit(FlatBVH &tree, int index, int depth, BVHBuildStats &stats) const
+  {
+    std::vector<LinearBVHNode> &out = tree.nodes;
+    const Node &node = nodes[index];
+    uint32_t out_index = static_cast<uint32_t>(out.size());
+    out.push_back(LinearBVHNode());
+    out[out_index].set_bounds(node.box);
+    stats.max_depth = std::max(stats.max_depth, depth);
+
+    if (emit_as_leaf(node))
+    {
+      out[out_index].offset = static_cast<uint32_t>(tree.prim_order.size());
+      out[out_index].count = static_cast<uint16_t>(node.count);
+      gather(index, tree.prim_order);
+      stats.leaf_nodes++;
+      stats.leaf_area += node.box.surface_area() * node.count;
+      return out_index;
+    }
+
+    stats.interior_nodes++;
+    stats.interior_area += node.box.surface_area();
+
+    // Split along the axis the children are farthest apart on, lower child first, which is the
+    // order ordered traversal expects
+    vec3 d = nodes[node.right].box.centroid() - nodes[node.left].box.centroid();
+    double dx = std::fabs(d.x), dy = std::fabs(d.y), dz = std::fabs(d.z);
+    int axis = (dx > dy && dx > dz) ? 0 : (dy > dz ? 1 : 2);
+    int lower = d[axis] < 0.0 ? node.right : node.left;
+    int upper = d[axis] < 0.0 ? node.left : node.right;
+
+    emit(tree, lower, depth + 1, stats);
+    uint32_t second = emit(tree, upper, depth + 1, stats);
+    out[out_index].offset = second;
+    out[out_index].count = 0;
+    out[out_index].axis = static_cast<uint8_t>(axis);
+    return out_index;
+  }
+};
+
+#endif // LBVH_H
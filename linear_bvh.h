@@ -0,0 +1,188 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include "bvh.h"
+#include "bvh_cache.h"
+#include "flat_bvh.h"
+#include "hittable.h"
+#include "lbvh.h"
+#include "simd.h"
+#include "wide_bvh.h"
+#include <chrono>
+#include <string>
+#include <vector>
+
+// BVH over primitives identified by index, built with the configured method and stored in the
+// widest layout requested. The owner keeps the primitives and intersects leaf ranges of
+// prim_order() through the same callbacks as FlatBVH::intersect and FlatBVH::intersect_any.
+class PrimitiveBVH
+{
+public:
+  // With options.cache_dir set, a tree saved by an earlier build of the same input is loaded from
+  // there instead of being built, and a freshly built one is saved for the next run.
+  void build(const std::vector<AABB> &prim_bounds, const BVHBuildOptions &options = BVHBuildOptions(), BVHBuildStats *stats = nullptr)
+  {
+    auto build_start = std::chrono::steady_clock::now();
+    BVHBuildStats local_stats;
+    BVHBuildStats &build_stats = stats ? *stats : local_stats;
+
+    bool use_cache = !options.cache_dir.empty() && !prim_bounds.empty();
+    uint64_t key = use_cache ? BVHCache::key(prim_bounds, options) : 0;
+    bool loaded = use_cache && BVHCache::load(BVHCache::path(options.cache_dir, key), key, prim_bounds.size(), tree, &build_stats);
+    if (loaded)
+    {
+      std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - build_start;
+      build_stats.build_ms = elapsed.count();
+      build_stats.builder = options.method == BVHBuildMethod::lbvh ? "lbvh" : "sah";
+      build_stats.cache = "hit";
+    }
+    else
+    {
+      if (options.method == BVHBuildMethod::lbvh)
+        LBVHBuilder::build(tree, prim_bounds, options, &build_stats);
+      else
+        tree.build(prim_bounds, options, &build_stats);
+      if (use_cache && BVHCache::store(options.cache_dir, key, tree, build_stats))
+        build_stats.cache = "written";
+    }
+
+    width = options.width != 0 ? options.width : preferred_width();
+    if (width == 8)
+      bvh8.build(tree);
+    else if (width == 4)
+      bvh4.build(tree);
+    else
+      width = 2;
+
+    if (stats)
+      stats->layout = layout();
+  }
+
+  template <typename LeafFn>
+  bool intersect(const ray &r, real t_min, real t_max, LeafFn &&leaf) const
+  {
+    if (width == 8)
+      return bvh8.intersect(r, t_min, t_max, leaf);
+    if (width == 4)
+      return bvh4.intersect(r, t_min, t_max, leaf);
+    return tree.intersect(r, t_min, t_max, leaf);
+  }
+
+  template <typename LeafFn>
+  bool intersect_any(const ray &r, real t_min, real t_max, LeafFn &&leaf) const
+  {
+    if (width == 8)
+      return bvh8.intersect_any(r, t_min, t_max, leaf);
+    if (width == 4)
+      return bvh4.intersect_any(r, t_min, t_max, leaf);
+    return tree.intersect_any(r, t_min, t_max, leaf);
+  }
+
+  // Primitive indices in leaf order: leaf ranges index into this
+  const std::vector<uint32_t> &prim_order() const { return tree.prim_order; }
+
+  // The binary tree every layout is built from; its leaves are the leaves of all of them
+  const FlatBVH &binary() const { return tree; }
+
+  AABB bounds() const { return tree.bounds(); }
+
+  std::string layout() const
+  {
+    if (width == 8)
+      return std::string("bvh8/") + SIMD::name(bvh8.kernel());
+    if (width == 4)
+      return std::string("bvh4/") + SIMD::name(bvh4.kernel());
+    return "bvh2/scalar";
+  }
+
+  // Widest layout this CPU has a kernel for: BVH8 with AVX2, BVH4 with SSE, else the binary tree
+  static int preferred_width()
+  {
+    SIMDLevel level = SIMD::level();
+    if (level == SIMDLevel::avx2)
+      return 8;
+    if (level == SIMDLevel::sse)
+      return 4;
+    return 2;
+  }
+
+private:
+  FlatBVH tree;
+  WideBVH<4> bvh4;
+  WideBVH<8> bvh8;
+  int width = 2;
+};
+
+// Scene-level BVH over Hittable objects, stored as a FlatBVH so traversal is a loop over one
+// contiguous node array instead of virtual calls through heap-allocated bvh_nodes. With a width
+// of 4 or 8 the binary tree is collapsed into a WideBVH and traversed with SIMD slab tests.
+class linear_bvh : public Hittable
+{
+public:
+  linear_bvh(const std::vector<Hittable *> &objects, const BVHBuildOptions &options = BVHBuildOptions(), BVHBuildStats *stats = nullptr)
+  {
+    std::vector<AABB> prim_bounds;
+    prim_bounds.reserve(objects.size());
+    for (const Hittable *object : objects)
+      prim_bounds.push_back(object->getBoundingBox());
+
+    accel.build(prim_bounds, options, stats);
+
+    // Store the objects in leaf order so every leaf is a contiguous run
+    primitives.reserve(objects.size());
+    for (uint32_t prim : accel.prim_order())
+      primitives.push_back(objects[prim]);
+
+    bbox = accel.bounds();
+  }
+
+  bool intersect(const ray &r, real t_min, real t_max, hit_record &rec) const override
+  {
+    auto leaf = [&](uint32_t first, uint32_t count, real &closest)
+    {
+      bool hit_anything = false;
+      for (uint32_t i = first; i < first + count; ++i)
+      {
+        if (primitives[i]->intersect(r, t_min, closest, rec))
+        {
+          hit_anything = true;
+          closest = rec.t;
+        }
+      }
+      return hit_anything;
+    };
+
+    return accel.intersect(r, t_min, t_max, leaf);
+  }
+
+  bool occluded(const ray &r, real t_min, real t_max) const override
+  {
+    auto leaf = [&](uint32_t first, uint32_t count)
+    {
+      for (uint32_t i = first; i < first + count; ++i)
+      {
+        if (primitives[i]->occluded(r, t_min, t_max))
+          return true;
+      }
+      return false;
+    };
+
+    return accel.intersect_any(r, t_min, t_max, leaf);
+  }
+
+  AABB getBoundingBox() const override { return bbox; }
+
+  // The objects themselves are owned by the scene, the BVH only references them
+  const std::vector<Hittable *> &objects() const { return primitives; }
+
+  std::string layout() const { return accel.layout(); }
+
+  static int preferred_width() { return PrimitiveBVH::preferred_width(); }
+
+private:
+  PrimitiveBVH accel;
+  std::vector<Hittable *> primitives;
+  AABB bbox;
+};
+
+#endif // LINEAR_BVH_H
\ No newline at end of file
@@ -0,0 +1,165 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RT_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file. Memory-mapped where the platform has mmap, so readers use the
+// page cache directly; read into one buffer otherwise.
+class MappedFile
+{
+public:
+  explicit MappedFile(const std::string &filename)
+  {
+    struct stat st;
+    if (::stat(filename.c_str(), &st) != 0)
+      return;
+    modified_time = static_cast<int64_t>(st.st_mtime);
+
+#if defined(RT_HAVE_MMAP)
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+    if (::fstat(fd, &st) == 0)
+    {
+      opened = true;
+      length = static_cast<size_t>(st.st_size);
+      if (length > 0)
+      {
+        void *mapping = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED)
+        {
+          ::madvise(mapping, length, MADV_SEQUENTIAL);
+          bytes = static_cast<const char *>(mapping);
+          mapped = true;
+        }
+        else
+          opened = false;
+      }
+    }
+    ::close(fd);
+#else
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open())
+      return;
+    buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    bytes = buffer.data();
+    length = buffer.size();
+    opened = true;
+#endif
+  }
+
+  ~MappedFile()
+  {
+#if defined(RT_HAVE_MMAP)
+    if (mapped)
+      ::munmap(const_cast<char *>(bytes), length);
+#endif
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  bool is_open() const { return opened; }
+  const char *data() const { return bytes; }
+  size_t size() const { return length; }
+  int64_t modified() const { return modified_time; } // Seconds since the epoch
+
+  // 64-bit hash of a byte range, eight bytes per multiply, so checking a cache against its source
+  // costs a small fraction of rebuilding what it stands for
+  static uint64_t content_hash(const char *data, size_t size)
+  {
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+      uint64_t word;
+      std::memcpy(&word, data + i, 8);
+      h = (h ^ word) * 0xff51afd7ed558ccdull;
+      h ^= h >> 32;
+    }
+    uint64_t tail = 0;
+    if (i < size)
+      std::memcpy(&tail, data + i, size - i);
+    h = (h ^ tail) * 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+  }
+
+  // Cache files start each buffer on a 64-byte boundary, so a mapped buffer can be used in place
+  // with any element type and shares no cache line with its neighbours
+  static constexpr uint64_t alignment = 64;
+
+  static uint64_t align(uint64_t offset) { return (offset + alignment - 1) / alignment * alignment; }
+
+  // True if count elements of element_bytes each, starting at offset, lie within a file of
+  // file_size bytes and the offset is aligned
+  static bool fits(uint64_t offset, uint64_t count, size_t element_bytes, size_t file_size)
+  {
+    return offset % alignment == 0 && offset <= file_size && count <= (file_size - offset) / element_bytes;
+  }
+
+  // Append bytes at an offset into the buffer, zero-filling the gap since the last append
+  static void append_at(std::vector<char> &buffer, uint64_t offset, const void *bytes, size_t size)
+  {
+    buffer.resize(offset, 0);
+    const char *first = static_cast<const char *>(bytes);
+    buffer.insert(buffer.end(), first, first + size);
+  }
+
+  // Write a header and a payload to a temporary file and rename it over path, so a reader mapping
+  // path meanwhile sees the old file or the new one, never half of one. Returns false if the
+  // directory is not writable.
+  static bool replace(const std::string &path, const void *header, size_t header_size, const std::vector<char> &payload)
+  {
+    std::string temp_path = path + ".tmp" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+    {
+      std::ofstream out(temp_path, std::ios::binary);
+      if (!out.is_open())
+        return false;
+      out.write(static_cast<const char *>(header), header_size);
+      out.write(payload.data(), payload.size());
+      if (!out.good())
+      {
+        out.close();
+        std::remove(temp_path.c_str());
+        return false;
+      }
+    }
+
+    // rename() does not replace an existing file everywhere
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0)
+    {
+      std::remove(path.c_str());
+      if (std::rename(temp_path.c_str(), path.c_str()) != 0)
+      {
+        std::remove(temp_path.c_str());
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  const char *bytes = nullptr;
+  size_t length = 0;
+  int64_t modified_time = 0;
+  bool opened = false;
+  bool mapped = false;
+  std::vector<char> buffer;
+};
+
+#endif // MAPPED_FILE_H
@@ -59,7 +59,7 @@ public:
       const override
   {
     vec3 reflected = ray::reflect(r_in.direction, rec.normal);
-    reflected = vec3::unit_vector(reflected) + (vec3::random_unit_vector() * fuzz);
+    reflected = vec3::mul_add(vec3::random_unit_vector(), fuzz, vec3::unit_vector(reflected));
     scattered = ray(rec.p, reflected, r_in.time());
     attenuation = albedo;
     rec.mat->reflectivity = reflectivity;
@@ -0,0 +1,211 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include "mapped_file.h"
+#include "obj_parser.h"
+#include "vec3.h"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Read-only array that either owns its elements or points into a mapped file, which it keeps open
+// for as long as any copy of the buffer exists
+template <typename T>
+class MeshBuffer
+{
+public:
+  MeshBuffer() = default;
+
+  MeshBuffer(std::vector<T> elements) : owned(std::move(elements)), elements(owned.data()), count(owned.size()) {}
+
+  MeshBuffer(std::shared_ptr<const MappedFile> file, const T *elements, size_t count)
+      : file(std::move(file)), elements(elements), count(count) {}
+
+  MeshBuffer(const MeshBuffer &other) : owned(other.owned), file(other.file), count(other.count)
+  {
+    elements = file ? other.elements : owned.data();
+  }
+
+  MeshBuffer(MeshBuffer &&other) noexcept
+      : owned(std::move(other.owned)), file(std::move(other.file)), count(other.count)
+  {
+    elements = file ? other.elements : owned.data();
+  }
+
+  MeshBuffer &operator=(MeshBuffer other) noexcept
+  {
+    owned.swap(other.owned);
+    file.swap(other.file);
+    count = other.count;
+    elements = file ? other.elements : owned.data();
+    return *this;
+  }
+
+  const T *data() const { return elements; }
+  size_t size() const { return count; }
+  const T &operator[](size_t i) const { return elements[i]; }
+  const T *begin() const { return elements; }
+  const T *end() const { return elements + count; }
+  bool is_mapped() const { return file != nullptr; }
+
+private:
+  std::vector<T> owned;
+  std::shared_ptr<const MappedFile> file;
+  const T *elements = nullptr;
+  size_t count = 0;
+};
+
+// Identity of the OBJ file a cache was made from
+struct MeshCacheKey
+{
+  uint64_t size = 0;
+  int64_t modified = 0;
+  uint64_t hash = 0;
+
+  static MeshCacheKey of(const MappedFile &file)
+  {
+    MeshCacheKey key;
+    key.size = file.size();
+    key.modified = file.modified();
+    key.hash = MappedFile::content_hash(file.data(), file.size());
+    return key;
+  }
+
+  bool operator==(const MeshCacheKey &other) const
+  {
+    return size == other.size && modified == other.modified && hash == other.hash;
+  }
+};
+
+// Start of an .rtmesh file. The vertex buffer and the index buffer follow, each on a 64-byte
+// boundary. Everything is stored in the native byte order and the vertices in the in-memory
+// vec3 layout, so a reader can use the buffers in place once the header says they match.
+struct MeshCacheHeader
+{
+  char magic[8];         // "RTMESH" and two zero bytes
+  uint32_t version;      // MeshCache::version
+  uint32_t byte_order;   // 0x01020304 as the writer stored it
+  uint32_t scalar_bytes; // sizeof(real): 8, or 4 for -DRT_FLOAT builds
+  uint32_t vertex_bytes; // sizeof(vec3)
+  MeshCacheKey source;
+  uint64_t vertex_count;
+  uint64_t index_count;
+  uint64_t vertex_offset;
+  uint64_t index_offset;
+  uint64_t faces;
+  uint64_t errors;
+  double bounds_min[3];
+  double bounds_max[3];
+  uint64_t payload_hash; // content_hash of everything after the header, to catch damaged files
+};
+
+// Binary cache of a parsed OBJ file, written next to it as <file>.rtmesh. A later load of the
+// same, unchanged file maps the cache and uses its vertex and index buffers in place instead of
+// parsing the text again. Set RT_MESH_CACHE=off to neither read nor write caches.
+class MeshCache
+{
+public:
+  static constexpr uint32_t version = 1;
+
+  static std::string path(const std::string &obj_filename) { return obj_filename + ".rtmesh"; }
+
+  static bool enabled()
+  {
+    const char *setting = std::getenv("RT_MESH_CACHE");
+    return !setting || (std::strcmp(setting, "off") != 0 && std::strcmp(setting, "0") != 0);
+  }
+
+  // Map the cache at cache_path if it was made from the file with this key, by a build with the
+  // same vec3 layout. Returns false, leaving the buffers alone, if it is missing, stale or damaged.
+  static bool load(const std::string &cache_path, const MeshCacheKey &key,
+                   MeshBuffer<vec3> &vertices, MeshBuffer<uint32_t> &indices, MeshStats *stats)
+  {
+    std::shared_ptr<const MappedFile> file = std::make_shared<MappedFile>(cache_path);
+    if (!file->is_open() || file->size() < sizeof(MeshCacheHeader))
+      return false;
+
+    MeshCacheHeader header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    MeshCacheHeader expected = make_header(key, 0, 0, MeshStats());
+    if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != version ||
+        header.byte_order != expected.byte_order || header.scalar_bytes != expected.scalar_bytes ||
+        header.vertex_bytes != expected.vertex_bytes || !(header.source == key))
+      return false;
+
+    if (header.index_count % 3 != 0 || header.vertex_count > UINT32_MAX ||
+        !MappedFile::fits(header.vertex_offset, header.vertex_count, sizeof(vec3), file->size()) ||
+        !MappedFile::fits(header.index_offset, header.index_count, sizeof(uint32_t), file->size()))
+      return false;
+
+    if (MappedFile::content_hash(file->data() + sizeof(header), file->size() - sizeof(header)) != header.payload_hash)
+      return false;
+
+    const vec3 *vertex_data = reinterpret_cast<const vec3 *>(file->data() + header.vertex_offset);
+    const uint32_t *index_data = reinterpret_cast<const uint32_t *>(file->data() + header.index_offset);
+
+    // A cache that matches its hash can still be hand-made or written by a buggy build, and every
+    // index is dereferenced on every ray, so one out of range must send the load back to the OBJ
+    for (uint64_t i = 0; i < header.index_count; ++i)
+    {
+      if (index_data[i] >= header.vertex_count)
+        return false;
+    }
+
+    vertices = MeshBuffer<vec3>(file, vertex_data, header.vertex_count);
+    indices = MeshBuffer<uint32_t>(file, index_data, header.index_count);
+    if (stats)
+    {
+      stats->file_bytes = key.size;
+      stats->vertices = header.vertex_count;
+      stats->faces = header.faces;
+      stats->triangles = header.index_count / 3;
+      stats->errors = header.errors;
+      stats->bounds = AABB(vec3(header.bounds_min[0], header.bounds_min[1], header.bounds_min[2]),
+                           vec3(header.bounds_max[0], header.bounds_max[1], header.bounds_max[2]));
+    }
+    return true;
+  }
+
+  // Write the cache for a freshly parsed mesh, replacing any older one in one rename. Returns
+  // false if the directory is not writable.
+  static bool store(const std::string &cache_path, const MeshCacheKey &key, const ObjMesh &mesh,
+                    const MeshStats &stats)
+  {
+    MeshCacheHeader header = make_header(key, mesh.vertices.size(), mesh.indices.size(), stats);
+    std::vector<char> payload;
+    MappedFile::append_at(payload, header.vertex_offset - sizeof(header), mesh.vertices.data(), mesh.vertices.size() * sizeof(vec3));
+    MappedFile::append_at(payload, header.index_offset - sizeof(header), mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+    header.payload_hash = MappedFile::content_hash(payload.data(), payload.size());
+    return MappedFile::replace(cache_path, &header, sizeof(header), payload);
+  }
+
+private:
+  static MeshCacheHeader make_header(const MeshCacheKey &key, size_t vertex_count, size_t index_count,
+                                     const MeshStats &stats)
+  {
+    MeshCacheHeader header = MeshCacheHeader();
+    std::memcpy(header.magic, "RTMESH\0\0", sizeof(header.magic));
+    header.version = version;
+    header.byte_order = 0x01020304;
+    header.scalar_bytes = sizeof(real);
+    header.vertex_bytes = sizeof(vec3);
+    header.source = key;
+    header.vertex_count = vertex_count;
+    header.index_count = index_count;
+    header.vertex_offset = MappedFile::align(sizeof(MeshCacheHeader));
+    header.index_offset = MappedFile::align(header.vertex_offset + vertex_count * sizeof(vec3));
+    header.faces = stats.faces;
+    header.errors = stats.errors;
+    for (int a = 0; a < 3; ++a)
+    {
+      header.bounds_min[a] = stats.bounds.min[a];
+      header.bounds_max[a] = stats.bounds.max[a];
+    }
+    return header;
+  }
+};
+
+#endif // MESH_CACHE_H
@@ -0,0 +1,408 @@
+#ifndef OBJ_PARSER_H
+#define OBJ_PARSER_H
+
+#include "aabb.h"
+#include "mapped_file.h"
+#include "util.h"
+#include "vec3.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Vertex positions and triangles of an OBJ file, three vertex indices per triangle
+struct ObjMesh
+{
+  std::vector<vec3> vertices;
+  std::vector<uint32_t> indices;
+};
+
+// Summary of an OBJ import, filled in when a stats pointer is handed to the parser
+struct MeshStats
+{
+  size_t file_bytes = 0;
+  size_t vertices = 0;
+  size_t faces = 0;     // Face lines read; a polygon counts once
+  size_t triangles = 0; // Triangles kept after splitting polygons and dropping bad faces
+  size_t errors = 0;    // Malformed lines and triangles with indices outside the vertex buffer
+  AABB bounds = AABB::empty();
+  double load_ms = 0.0; // Mapping, parsing and merging, without the BVH build
+  std::string cache;    // "hit" or "written" when the mesh went through its .rtmesh cache (mesh_cache.h)
+
+  void print(const std::string &label) const
+  {
+    std::cout << "Mesh (" << label << "): " << vertices << " vertices, " << faces << " faces, "
+              << triangles << " triangles";
+    if (errors > 0)
+      std::cout << ", " << errors << " errors";
+    std::cout << ", bounds X [" << bounds.min.x << ", " << bounds.max.x << "] Y [" << bounds.min.y << ", "
+              << bounds.max.y << "] Z [" << bounds.min.z << ", " << bounds.max.z << "], loaded "
+              << file_bytes << " bytes in " << load_ms << " ms";
+    if (!cache.empty())
+      std::cout << ", cache " << cache;
+    std::cout << std::endl;
+  }
+};
+
+// OBJ reader for the vertex positions ("v") and faces ("f") of a mesh. The file is mapped, cut
+// into chunks at line breaks and the chunks are parsed on separate threads, then merged into one
+// vertex buffer and one index buffer in file order. Faces may use the v/vt/vn forms and negative
+// (relative) indices; polygons are split into a triangle fan. Every other line is skipped.
+class ObjParser
+{
+public:
+  // threads: 0 uses every thread of the shared pool. The counts and bounds in stats come out of
+  // the same pass, so callers never need to read the file a second time for them
+  static ObjMesh parse(const std::string &filename, unsigned threads = 0, MeshStats *stats = nullptr)
+  {
+    auto load_start = std::chrono::steady_clock::now();
+    MappedFile file(filename);
+    if (!file.is_open())
+      throw std::runtime_error("Could not open OBJ file");
+
+    ObjMesh mesh = parse(file, threads, stats);
+    if (stats)
+    {
+      std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - load_start;
+      stats->load_ms = elapsed.count();
+    }
+    return mesh;
+  }
+
+  // Parse an OBJ file that is already open
+  static ObjMesh parse(const MappedFile &file, unsigned threads = 0, MeshStats *stats = nullptr)
+  {
+    auto load_start = std::chrono::steady_clock::now();
+    if (threads == 0)
+      threads = Util::default_threads();
+    std::vector<Chunk> chunks = split(file.data(), file.size(), threads);
+
+    // Parse: each chunk collects its own vertices and face corners
+    Util::parallel_for(chunks.size(), threads, [&](size_t c)
+                       { parse_chunk(chunks[c]); });
+
+    std::vector<size_t> vertex_base(chunks.size() + 1, 0);
+    for (size_t c = 0; c < chunks.size(); ++c)
+      vertex_base[c + 1] = vertex_base[c] + chunks[c].vertices.size();
+    const int64_t vertex_count = static_cast<int64_t>(vertex_base.back());
+
+    // Resolve the relative indices now that each chunk knows its first vertex, and drop the
+    // triangles that point outside the vertex buffer
+    Util::parallel_for(chunks.size(), threads, [&](size_t c)
+                       { resolve_chunk(chunks[c], static_cast<int64_t>(vertex_base[c]), vertex_count); });
+
+    std::vector<size_t> index_base(chunks.size() + 1, 0);
+    for (size_t c = 0; c < chunks.size(); ++c)
+      index_base[c + 1] = index_base[c] + chunks[c].indices.size();
+
+    // Merge into the shared buffers, each chunk copying its own range
+    ObjMesh mesh;
+    mesh.vertices.resize(vertex_base.back());
+    mesh.indices.resize(index_base.back());
+    Util::parallel_for(chunks.size(), threads, [&](size_t c)
+                       {
+      std::copy(chunks[c].vertices.begin(), chunks[c].vertices.end(), mesh.vertices.begin() + vertex_base[c]);
+      std::copy(chunks[c].indices.begin(), chunks[c].indices.end(), mesh.indices.begin() + index_base[c]); });
+
+    MeshStats local_stats;
+    for (const Chunk &chunk : chunks)
+    {
+      for (const std::string &error : chunk.errors)
+        std::cerr << error << std::endl;
+      local_stats.faces += chunk.faces;
+      local_stats.errors += chunk.errors.size();
+      local_stats.bounds = AABB::combine(local_stats.bounds, chunk.bounds);
+    }
+
+    if (stats)
+    {
+      std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - load_start;
+      local_stats.file_bytes = file.size();
+      local_stats.vertices = mesh.vertices.size();
+      local_stats.triangles = mesh.indices.size() / 3;
+      local_stats.load_ms = elapsed.count();
+      *stats = local_stats;
+    }
+    return mesh;
+  }
+
+  // Parse a decimal floating-point number at p, not reading past end, and advance p past it.
+  // Numbers with at most 19 significant digits and a small exponent are converted exactly
+  // (the mantissa and the power of ten are both exact doubles, so the one rounding of the
+  // multiply or divide is the correct one); anything longer goes through strtod.
+  static bool parse_real(const char *&p, const char *end, double &value)
+  {
+    const char *start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+      negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0;   // Significant digits in the mantissa
+    int exponent = 0; // Power of ten the mantissa is scaled by
+    bool any_digit = false, exact = true;
+    for (; p < end && is_digit(*p); ++p)
+    {
+      any_digit = true;
+      if (digits < 19)
+      {
+        mantissa = mantissa * 10 + (*p - '0');
+        digits += mantissa != 0;
+      }
+      else
+      {
+        exact &= *p == '0';
+        ++exponent;
+      }
+    }
+    if (p < end && *p == '.')
+    {
+      for (++p; p < end && is_digit(*p); ++p)
+      {
+        any_digit = true;
+        if (digits < 19)
+        {
+          mantissa = mantissa * 10 + (*p - '0');
+          digits += mantissa != 0;
+          --exponent;
+        }
+        else
+          exact &= *p == '0';
+      }
+    }
+    if (!any_digit)
+      return parse_real_slow(start, end, p, value);
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+      const char *q = p + 1;
+      bool negative_exponent = false;
+      if (q < end && (*q == '-' || *q == '+'))
+        negative_exponent = *q++ == '-';
+      if (q == end || !is_digit(*q))
+        return parse_real_slow(start, end, p, value);
+      int e = 0;
+      for (; q < end && is_digit(*q); ++q)
+        e = e < 10000 ? e * 10 + (*q - '0') : e;
+      exponent += negative_exponent ? -e : e;
+      p = q;
+    }
+
+    if (!exact || mantissa > (uint64_t(1) << 53) || exponent < -22 || exponent > 22)
+      return parse_real_slow(start, end, p, value);
+
+    static const double powers_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                           1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    value = static_cast<double>(mantissa);
+    value = exponent < 0 ? value / powers_of_ten[-exponent] : value * powers_of_ten[exponent];
+    if (negative)
+      value = -value;
+    return true;
+  }
+
+  // Parse a signed decimal integer at p and advance p past it
+  static bool parse_index(const char *&p, const char *end, int64_t &value)
+  {
+    const char *q = p;
+    bool negative = false;
+    if (q < end && (*q == '-' || *q == '+'))
+      negative = *q++ == '-';
+    if (q == end || !is_digit(*q))
+      return false;
+    int64_t v = 0;
+    for (; q < end && is_digit(*q); ++q)
+      v = v < (int64_t(1) << 40) ? v * 10 + (*q - '0') : v;
+    value = negative ? -v : v;
+    p = q;
+    return true;
+  }
+
+private:
+  // Files below this size are parsed as one chunk; larger ones get chunks of at least this size
+  static constexpr size_t min_chunk_bytes = 256 * 1024;
+
+  struct Chunk
+  {
+    const char *begin, *end;
+    std::vector<vec3> vertices;
+    std::vector<int64_t> corners;  // Three vertex indices per triangle; see relative
+    std::vector<size_t> relative;  // Positions in corners still relative to the chunk's first vertex
+    std::vector<uint32_t> indices; // corners resolved against the whole file, bad triangles dropped
+    std::vector<std::string> errors;
+    AABB bounds = AABB::empty(); // Of the vertices
+    size_t faces = 0;
+  };
+
+  static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+  static bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+  static void skip_blanks(const char *&p, const char *end)
+  {
+    while (p < end && is_blank(*p))
+      ++p;
+  }
+
+  static bool parse_real_slow(const char *start, const char *end, const char *&p, double &value)
+  {
+    char token[64];
+    size_t length = 0;
+    while (start + length < end && !is_blank(start[length]) && length + 1 < sizeof(token))
+    {
+      token[length] = start[length];
+      ++length;
+    }
+    token[length] = '\0';
+    char *parsed_end;
+    value = std::strtod(token, &parsed_end);
+    if (parsed_end == token)
+    {
+      p = start;
+      return false;
+    }
+    p = start + (parsed_end - token);
+    return true;
+  }
+
+  // Cut [data, data + size) into about four chunks per thread, each ending after a line break
+  static std::vector<Chunk> split(const char *data, size_t size, unsigned threads)
+  {
+    size_t count = std::max<size_t>(1, std::min<size_t>(size_t(threads) * 4, size / min_chunk_bytes));
+    std::vector<Chunk> chunks;
+    const char *begin = data, *end = data + size;
+    for (size_t c = 1; c <= count && begin < end; ++c)
+    {
+      const char *cut = c == count ? end : data + size / count * c;
+      if (cut < begin)
+        cut = begin;
+      if (cut < end)
+      {
+        const char *eol = static_cast<const char *>(std::memchr(cut, '\n', end - cut));
+        cut = eol ? eol + 1 : end;
+      }
+      Chunk chunk;
+      chunk.begin = begin;
+      chunk.end = cut;
+      chunks.push_back(std::move(chunk));
+      begin = cut;
+    }
+    return chunks;
+  }
+
+  static void parse_chunk(Chunk &chunk)
+  {
+    std::vector<int64_t> face;
+    const char *p = chunk.begin;
+    while (p < chunk.end)
+    {
+      const char *eol = static_cast<const char *>(std::memchr(p, '\n', chunk.end - p));
+      if (!eol)
+        eol = chunk.end;
+      const char *line = p;
+      skip_blanks(p, eol);
+
+      // Vertex lines (v x y z)
+      if (eol - p > 1 && p[0] == 'v' && is_blank(p[1]))
+      {
+        p += 1;
+        double xyz[3] = {0.0, 0.0, 0.0};
+        bool ok = true;
+        for (int a = 0; a < 3 && ok; ++a)
+        {
+          skip_blanks(p, eol);
+          ok = parse_real(p, eol, xyz[a]);
+        }
+        // Keep the vertex even if it is malformed, so the indices of the ones after it still line up
+        if (!ok)
+          chunk.errors.push_back("Error parsing vertex line: " + trimmed(line, eol));
+        chunk.vertices.push_back(vec3(xyz[0], xyz[1], xyz[2]));
+        chunk.bounds.extend(chunk.vertices.back());
+      }
+      // Face lines (f v1 v2 v3 ..., each corner optionally followed by /vt/vn)
+      else if (eol - p > 1 && p[0] == 'f' && is_blank(p[1]))
+      {
+        p += 1;
+        face.clear();
+        bool ok = true;
+        while (true)
+        {
+          skip_blanks(p, eol);
+          if (p == eol)
+            break;
+          int64_t index;
+          if (!parse_index(p, eol, index))
+          {
+            ok = false;
+            break;
+          }
+          while (p < eol && !is_blank(*p)) // Texture and normal indices
+            ++p;
+          face.push_back(index);
+        }
+
+        if (!ok || face.size() < 3)
+          chunk.errors.push_back("Error parsing face line: " + trimmed(line, eol));
+        else
+        {
+          ++chunk.faces;
+          for (size_t k = 1; k + 1 < face.size(); ++k)
+          {
+            add_corner(chunk, face[0]);
+            add_corner(chunk, face[k]);
+            add_corner(chunk, face[k + 1]);
+          }
+        }
+      }
+      p = eol + 1;
+    }
+  }
+
+  // OBJ indices are 1-based; negative ones count back from the last vertex read so far
+  static void add_corner(Chunk &chunk, int64_t index)
+  {
+    if (index < 0)
+    {
+      chunk.relative.push_back(chunk.corners.size());
+      chunk.corners.push_back(static_cast<int64_t>(chunk.vertices.size()) + index);
+    }
+    else
+      chunk.corners.push_back(index - 1);
+  }
+
+  static void resolve_chunk(Chunk &chunk, int64_t first_vertex, int64_t vertex_count)
+  {
+    for (size_t position : chunk.relative)
+      chunk.corners[position] += first_vertex;
+
+    chunk.indices.reserve(chunk.corners.size());
+    for (size_t i = 0; i + 2 < chunk.corners.size(); i += 3)
+    {
+      const int64_t *corner = &chunk.corners[i];
+      bool valid = true;
+      for (int k = 0; k < 3; ++k)
+        valid &= corner[k] >= 0 && corner[k] < vertex_count;
+      if (!valid)
+      {
+        chunk.errors.push_back("Invalid vertex indices for face: " + std::to_string(corner[0] + 1) + ", " +
+                               std::to_string(corner[1] + 1) + ", " + std::to_string(corner[2] + 1));
+        continue;
+      }
+      for (int k = 0; k < 3; ++k)
+        chunk.indices.push_back(static_cast<uint32_t>(corner[k]));
+    }
+    std::vector<int64_t>().swap(chunk.corners);
+  }
+
+  static std::string trimmed(const char *begin, const char *end)
+  {
+    while (end > begin && is_blank(end[-1]))
+      --end;
+    return std::string(begin, end);
+  }
+};
+
+#endif // OBJ_PARSER_H
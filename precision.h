@@ -0,0 +1,31 @@
+#ifndef PRECISION_H
+#define PRECISION_H
+
+// Scalar type of the geometry pipeline: vec3, ray, AABB, hit records, the primitives and BVH
+// traversal. Doubles by default. Building with -DRT_FLOAT gives a float renderer that moves half
+// the bytes per vector; keep doubles for scenes that need them, such as the huge ground spheres.
+// Shading (colors, materials, textures) and BVH construction stay in double either way.
+#if defined(RT_FLOAT)
+typedef float real;
+#else
+typedef double real;
+#endif
+
+class Precision
+{
+public:
+  static constexpr bool is_float() { return sizeof(real) == sizeof(float); }
+
+  // Whether a ray/plane determinant is too small to divide by, i.e. the ray runs parallel to a
+  // triangle or quad. Doubles keep the absolute 1e-8 threshold. In float the rounding error of
+  // the determinant grows with the vectors it came from, so the test is relative to scale_sq,
+  // the product of their squared lengths.
+  static bool parallel(real det, real scale_sq)
+  {
+    if (!is_float())
+      return det > real(-1e-8) && det < real(1e-8);
+    return det * det <= real(1e-12) * scale_sq;
+  }
+};
+
+#endif // PRECISION_H
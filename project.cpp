@@ -12,6 +12,7 @@
 #include <stdexcept>
 #include <tuple>
 #include <memory>
+#include <random>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "rtw_stb_image.h"
@@ -28,13 +29,65 @@
 #include "hittable_list.h"
 #include "aabb.h"
 #include "bvh.h"
+#include "bvh_cache.h"
+#include "linear_bvh.h"
 #include "material.h"
 #include "scene_setup.h"
+#include "thread_pool.h"
 
 // command to compile:
 //  g++ -std=c++14 project.cpp camera.cpp scene_setup.cpp rtw_stb_image.cpp -o ray-tracer
 
 #define IW 960 // image width 240, 480, 960, 1920, 3840
+
+// Parse a whole string as a number. Returns false, leaving value alone, if it is not one.
+template <typename T>
+static bool parse_number(const std::string &text, T &value)
+{
+  std::istringstream in(text);
+  T parsed;
+  if (!(in >> parsed) || !in.eof())
+    return false;
+  value = parsed;
+  return true;
+}
+
+// Apply one --name=value option to the render or thread pool options. Returns false for an unknown
+// option or value.
+static bool parse_option(const std::string &arg, RenderOptions &options, ThreadPoolOptions &pool_options)
+{
+  size_t equals = arg.find('=');
+  if (equals == std::string::npos)
+    return false;
+  std::string name = arg.substr(0, equals);
+  std::string value = arg.substr(equals + 1);
+  if (name == "--tile-size")
+    return parse_number(value, options.tile_size) && options.tile_size > 0;
+  if (name == "--tile-order")
+    return TileScheduler::parse(value, options.tile_order);
+  if (name == "--seed")
+    return parse_number(value, options.seed);
+  if (name == "--noise-threshold")
+    return parse_number(value, options.noise_threshold) && options.noise_threshold >= 0.0;
+  if (name == "--min-samples")
+    return parse_number(value, options.min_samples) && options.min_samples > 0;
+  if (name == "--max-samples")
+    return parse_number(value, options.max_samples) && options.max_samples >= 0;
+  if (name == "--pass-samples")
+    return parse_number(value, options.pass_samples) && options.pass_samples > 0;
+  if (name == "--time-budget")
+    return parse_number(value, options.time_budget_s) && options.time_budget_s >= 0.0;
+  if (name == "--error-target")
+    return parse_number(value, options.error_target) && options.error_target >= 0.0;
+  if (name == "--flush-interval")
+    return parse_number(value, options.flush_interval_s) && options.flush_interval_s >= 0.0;
+  if (name == "--threads")
+    return ThreadPoolOptions::parse_threads(value, pool_options.threads);
+  if (name == "--cpus")
+    return ThreadPoolOptions::parse_cpus(value, pool_options.cpus);
+  return false;
+}
+
 int main(int argc, char *argv[])
 {
   // Define camera quality: Higher => Nicer image but longer run-time
@@ -47,12 +100,46 @@ int main(int argc, char *argv[])
   std::vector<std::unique_ptr<material>> materials;
   std::vector<std::unique_ptr<texture>> textures;
 
+  // Arguments starting with -- set options: --tile-size=16, --tile-order=hilbert|morton|scanline,
+  // --seed=N, --noise-threshold=X, --min-samples=N, --max-samples=N, the progressive rendering
+  // options --pass-samples=N, --time-budget=SECONDS, --error-target=X and --flush-interval=SECONDS,
+  // --threads=N and --cpus=LIST. The last two override RT_THREADS and RT_CPUS and size the thread
+  // pool shared by mesh loading, BVH builds and rendering. The others are positional.
+  RenderOptions render_options;
+  render_options.seed = std::random_device()();
+  bool seed_given = false;
+  if (const char *seed = std::getenv("RT_SEED"))
+  {
+    if (parse_number(std::string(seed), render_options.seed))
+      seed_given = true;
+    else
+      std::cerr << "Invalid RT_SEED: " << seed << ". Ignoring it." << std::endl;
+  }
+  ThreadPoolOptions pool_options = ThreadPoolOptions::from_environment();
+  std::vector<std::string> args;
+  for (int a = 1; a < argc; ++a)
+  {
+    std::string arg = argv[a];
+    if (arg.compare(0, 2, "--") != 0)
+      args.push_back(arg);
+    else if (!parse_option(arg, render_options, pool_options))
+      std::cerr << "Invalid option: " << arg << ". Ignoring it." << std::endl;
+    else if (arg.compare(0, 7, "--seed=") == 0)
+      seed_given = true;
+  }
+  ThreadPool::configure(pool_options);
+
+  // The seed places the random objects of scenes 3 and 4 and drives every sample, so the same
+  // seed and options reproduce an image exactly
+  std::cout << "Seed: " << render_options.seed << std::endl;
+  Util::seed(render_options.seed);
+
   int scene_number = 1; // Default to 1
-  if (argc >= 2)
+  if (args.size() >= 1)
   {
     try
     {
-      scene_number = std::stoi(argv[1]);
+      scene_number = std::stoi(args[0]);
     }
     catch (...)
     {
@@ -60,28 +147,54 @@ int main(int argc, char *argv[])
     }
   }
 
-  bvh_node *root = nullptr;
+  // Optional second argument picks the BVH builder: sah (default, best render speed), lbvh
+  // (fastest build) or lbvh-opt (LBVH followed by treelet restructuring)
+  BVHBuildOptions bvh_options;
+  if (args.size() >= 2)
+  {
+    std::string builder = args[1];
+    if (builder == "lbvh" || builder == "lbvh-opt")
+    {
+      bvh_options.method = BVHBuildMethod::lbvh;
+      bvh_options.treelet_passes = builder == "lbvh-opt" ? 2 : 0;
+    }
+    else if (builder != "sah")
+    {
+      std::cerr << "Unknown BVH builder: " << builder << ". Using sah." << std::endl;
+    }
+  }
+
+  // Built BVHs are saved to bvh_cache/ and loaded on later runs; RT_BVH_CACHE names another
+  // directory, or turns the cache off with RT_BVH_CACHE=off
+  bvh_options.cache_dir = BVHCache::default_directory();
+
+  Hittable *root = nullptr;
 
   switch (scene_number)
   {
   case 1:
-    root = setup_scene_1(materials, textures, cam_config);
+    root = setup_scene_1(materials, textures, cam_config, bvh_options);
     break;
   case 2:
-    root = setup_scene_2(materials, textures, cam_config);
+    root = setup_scene_2(materials, textures, cam_config, bvh_options);
     break;
   case 3:
-    root = setup_scene_3(materials, textures, cam_config);
+    root = setup_scene_3(materials, textures, cam_config, bvh_options, seed_given);
+    break;
+  case 4:
+    root = setup_scene_4(materials, textures, cam_config, bvh_options, seed_given);
     break;
   default:
     std::cerr << "Unknown scene number: " << scene_number << ". Using default scene 1." << std::endl;
-    root = setup_scene_1(materials, textures, cam_config);
+    root = setup_scene_1(materials, textures, cam_config, bvh_options);
     break;
   }
 
   Camera c(image_width, cam_config.aspect_ratio, cam_config.position, cam_config.look_at,
            cam_config.up, cam_config.fov, samples, cam_config.background_color, root);
-  c.render();
+  RenderStats render_stats;
+  c.render(render_options, &render_stats);
+  render_stats.print();
 
   return 0;
 }
\ No newline at end of file
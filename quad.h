@@ -45,16 +45,17 @@ public:
 
   AABB getBoundingBox() const override { return bbox; }
 
-  bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override
+  // Records the plane coordinates of the hit in rec.u and rec.v, through is_interior()
+  bool intersect(const ray &r, real t_min, real t_max, hit_record &rec) const override
   {
     auto denom = vec3::dot(normal, r.direction);
     ;
     // No hit if the ray is parallel to the plane.
-    if (std::fabs(denom) < 1e-8)
+    if (Precision::parallel(denom, r.direction.length_squared()))
       return false;
     ;
     // Return false if the hit point parameter t is outside the ray interval.
-    double t = (D - vec3::dot(normal, r.origin)) / denom;
+    real t = (D - vec3::dot(normal, r.origin)) / denom;
     if (t < t_min || t > t_max)
       return false;
     ;
@@ -67,19 +68,47 @@ public:
     if (!is_interior(alpha, beta, rec))
       return false;
     rec.t = t;
-    rec.p = intersection;
+    rec.object = this;
+
+    return true;
+  }
+
+  void finalize_hit(const ray &r, hit_record &rec) const override
+  {
+    rec.p = r.at(rec.t);
     rec.mat = mat;
     rec.set_face_normal(r, normal);
+  }
 
-    return true;
+  bool occluded(const ray &r, real t_min, real t_max) const override
+  {
+    auto denom = vec3::dot(normal, r.direction);
+    if (Precision::parallel(denom, r.direction.length_squared()))
+      return false;
+
+    real t = (D - vec3::dot(normal, r.origin)) / denom;
+    if (t < t_min || t > t_max)
+      return false;
+
+    vec3 planar_hitpt_vector = r.at(t) - Q;
+    auto alpha = vec3::dot(w, vec3::cross(planar_hitpt_vector, v));
+    auto beta = vec3::dot(w, vec3::cross(u, planar_hitpt_vector));
+    return contains(alpha, beta);
+  }
+
+  // Given the hit point in plane coordinates, return whether it lies inside the primitive.
+  // Other planar shapes override this together with is_interior().
+  virtual bool contains(real a, real b) const
+  {
+    return !(a < 0 || a > 1 || b < 0 || b > 1);
   }
 
-  virtual bool is_interior(double a, double b, hit_record &rec) const
+  virtual bool is_interior(real a, real b, hit_record &rec) const
   {
     // Given the hit point in plane coordinates, return false if it is outside the
     // primitive, otherwise set the hit record UV coordinates and return true.
 
-    if (a < 0 || a > 1 || b < 0 || b > 1)
+    if (!contains(a, b))
       return false;
 
     rec.u = a;
@@ -94,7 +123,7 @@ private:
   material *mat;
   AABB bbox;
   vec3 normal;
-  double D;
+  real D;
 };
 
 #endif
\ No newline at end of file
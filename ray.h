@@ -2,48 +2,59 @@
 #define RAY_H
 
 #include "vec3.h" // Assuming the vec3 class is already defined
+#include <cmath>
 
 class ray
 {
 public:
   vec3 origin;    // The starting point of the ray
   vec3 direction; // The direction vector of the ray
-  double tm;
+  real tm;
+
+  // Cached for slab tests, computed once per ray by the constructors: 1 / direction per axis
+  // (+-inf on axes the ray is parallel to) and 1 where that reciprocal is negative, 0 otherwise.
+  // Build a new ray rather than assigning to direction, or these go stale.
+  vec3 inv_direction;
+  int sign[3];
 
   // Default constructor
-  ray() : origin(vec3(0.0, 0.0, 0.0)), direction(vec3(0.0, 0.0, 0.0)), tm(0) {}
+  ray() : origin(vec3(0.0, 0.0, 0.0)), direction(vec3(0.0, 0.0, 0.0)), tm(0) { cache_direction(); }
 
   // Parameterized constructor
-  ray(const vec3 &origin, const vec3 &direction, double time)
-      : origin(origin), direction(direction), tm(time) {}
+  ray(const vec3 &origin, const vec3 &direction, real time)
+      : origin(origin), direction(direction), tm(time) { cache_direction(); }
 
   ray(const vec3 &origin, const vec3 &direction)
-      : origin(origin), direction(direction), tm(0) {}
+      : origin(origin), direction(direction), tm(0) { cache_direction(); }
 
-  double time() const { return tm; }
+  real time() const { return tm; }
 
   // Function to return the position at a given time t
-  vec3 at(double t) const
+  vec3 at(real t) const
   {
-    return origin + direction * t;
+    return vec3::mul_add(direction, t, origin);
   }
 
   // Static function to reflect vector v against the normal vector n
   static vec3 reflect(const vec3 &v, const vec3 &n)
   {
-    double temp = 2 * vec3::dot(v, n);
-    vec3 result = vec3::scale(n, temp);
-    result = vec3::sub(v, result);
-    return result;
+    return vec3::mul_add(n, -2 * vec3::dot(v, n), v);
+  }
+
+  static vec3 refract(const vec3 &uv, const vec3 &n, real etai_over_etat)
+  {
+    real cos_theta = std::fmin(-vec3::dot(uv, n), real(1.0));
+    vec3 r_out_perp = vec3::mul_add(n, cos_theta, uv) * etai_over_etat;
+    return vec3::mul_add(n, -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared())), r_out_perp);
   }
 
-  static vec3 refract(const vec3 &uv, const vec3 &n, double etai_over_etat)
+private:
+  void cache_direction()
   {
-    // double cos_theta = std::fmin((uv * -1.0) * n, 1.0);
-    double cos_theta = std::fmin(vec3::dot((uv * -1.0), n), 1.0);
-    vec3 r_out_perp = (uv + (n * cos_theta)) * etai_over_etat;
-    vec3 r_out_parallel = n * -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared()));
-    return r_out_perp + r_out_parallel;
+    inv_direction = vec3(1.0 / direction.x, 1.0 / direction.y, 1.0 / direction.z);
+    sign[0] = std::signbit(inv_direction.x);
+    sign[1] = std::signbit(inv_direction.y);
+    sign[2] = std::signbit(inv_direction.z);
   }
 };
 
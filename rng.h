@@ -0,0 +1,54 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+// PCG32 (O'Neill, pcg-random.org): 64 bits of state, a 32-bit output per step and 2^63
+// independent streams. Each thread draws from its own generator, so sampling needs no locks and
+// no shared cache lines, and reseeding per pixel makes a render depend only on the seed.
+class PCG32
+{
+public:
+  // Restart at the beginning of one stream of the sequence for seed. Different streams of the
+  // same seed are uncorrelated, so (job seed, pixel index) pairs give every pixel its own.
+  void seed(uint64_t seed, uint64_t stream = 0)
+  {
+    state = 0;
+    inc = (stream << 1) | 1;
+    next();
+    state += seed;
+    next();
+  }
+
+  uint32_t next()
+  {
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + inc;
+    uint32_t xorshifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+    uint32_t rot = static_cast<uint32_t>(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+  }
+
+  // Uniform in [0, 1), in steps of 2^-32
+  double next_double() { return next() * (1.0 / 4294967296.0); }
+
+  // Uniform in [0, bound), without the bias of next() % bound
+  uint32_t next_below(uint32_t bound)
+  {
+    uint32_t threshold = (0u - bound) % bound;
+    for (;;)
+    {
+      uint32_t r = next();
+      if (r >= threshold)
+        return r % bound;
+    }
+  }
+
+private:
+  // The generator a thread starts with before anything seeds it. Constant-initialized, so a
+  // thread_local PCG32 costs no construction guard on access.
+  uint64_t state = 0x853c49e6748fea9bULL;
+  uint64_t inc = 0xda3e39cb94b95bdbULL;
+};
+
+#endif // RNG_H
@@ -1,9 +1,10 @@
 #include "scene_setup.h"
 #include "color.h"
 
-bvh_node *setup_scene_1(std::vector<std::unique_ptr<material>> &materials,
+Hittable *setup_scene_1(std::vector<std::unique_ptr<material>> &materials,
                         std::vector<std::unique_ptr<texture>> &textures,
-                        CameraConfig &cam_config)
+                        CameraConfig &cam_config,
+                        const BVHBuildOptions &bvh_options)
 {
 
   // Set camera position and orientation
@@ -143,11 +144,11 @@ bvh_node *setup_scene_1(std::vector<std::unique_ptr<material>> &materials,
     textures.push_back(std::move(bronze_tex));
     materials.push_back(std::move(bronze_mat));
 
-    // Print bounding box of OBJ
-    Util::print_obj_bounding_box(obj_file);
-
-    HittableList obj = HittableList::load_triangles_from_obj(obj_file, bronze_mat_ptr);
-    scene.push_back(new HittableList(std::move(obj)));
+    MeshStats mesh_stats;
+    BVHBuildStats mesh_bvh_stats;
+    scene.push_back(new TriangleMesh(TriangleMesh::load_obj(obj_file, bronze_mat_ptr, bvh_options, &mesh_stats, &mesh_bvh_stats)));
+    mesh_stats.print(obj_file);
+    mesh_bvh_stats.print(obj_file);
   }
   catch (const std::exception &e)
   {
@@ -157,7 +158,9 @@ bvh_node *setup_scene_1(std::vector<std::unique_ptr<material>> &materials,
   for (auto *obj : scene)
     obj->bounding_box = obj->getBoundingBox();
 
-  bvh_node *root = new bvh_node(scene.data(), 0, scene.size());
+  BVHBuildStats stats;
+  Hittable *root = new linear_bvh(scene, bvh_options, &stats);
+  stats.print("scene 1");
 
   for (auto &obj : scene)
     obj = nullptr;
@@ -165,9 +168,10 @@ bvh_node *setup_scene_1(std::vector<std::unique_ptr<material>> &materials,
   return root;
 }
 
-bvh_node *setup_scene_2(std::vector<std::unique_ptr<material>> &materials,
+Hittable *setup_scene_2(std::vector<std::unique_ptr<material>> &materials,
                         std::vector<std::unique_ptr<texture>> &textures,
-                        CameraConfig &cam_config)
+                        CameraConfig &cam_config,
+                        const BVHBuildOptions &bvh_options)
 {
 
   cam_config.position = vec3(0.0, 8.0, 25.0);
@@ -268,11 +272,11 @@ bvh_node *setup_scene_2(std::vector<std::unique_ptr<material>> &materials,
     textures.push_back(std::move(bronze_tex));
     materials.push_back(std::move(bronze_mat));
 
-    // Print bounding box of OBJ
-    Util::print_obj_bounding_box(obj_file);
-
-    HittableList obj = HittableList::load_triangles_from_obj(obj_file, bronze_mat_ptr);
-    scene.push_back(new HittableList(std::move(obj)));
+    MeshStats mesh_stats;
+    BVHBuildStats mesh_bvh_stats;
+    scene.push_back(new TriangleMesh(TriangleMesh::load_obj(obj_file, bronze_mat_ptr, bvh_options, &mesh_stats, &mesh_bvh_stats)));
+    mesh_stats.print(obj_file);
+    mesh_bvh_stats.print(obj_file);
   }
   catch (const std::exception &e)
   {
@@ -282,7 +286,9 @@ bvh_node *setup_scene_2(std::vector<std::unique_ptr<material>> &materials,
   for (auto *obj : scene)
     obj->bounding_box = obj->getBoundingBox();
 
-  bvh_node *root = new bvh_node(scene.data(), 0, scene.size());
+  BVHBuildStats stats;
+  Hittable *root = new linear_bvh(scene, bvh_options, &stats);
+  stats.print("scene 2");
 
   for (auto &obj : scene)
     obj = nullptr;
@@ -290,9 +296,22 @@ bvh_node *setup_scene_2(std::vector<std::unique_ptr<material>> &materials,
   return root;
 }
 
-bvh_node *setup_scene_3(std::vector<std::unique_ptr<material>> &materials,
+// Build options for the BVH over a scene laid out from the job seed. A seed chosen with --seed or
+// RT_SEED gives the same primitive bounds, and so the same cache key, on every run; a random seed
+// is never drawn again, so its tree is not worth a cache file.
+static BVHBuildOptions seeded_scene_options(const BVHBuildOptions &bvh_options, bool seeded_layout)
+{
+  BVHBuildOptions options = bvh_options;
+  if (!seeded_layout)
+    options.cache_dir.clear();
+  return options;
+}
+
+Hittable *setup_scene_3(std::vector<std::unique_ptr<material>> &materials,
                         std::vector<std::unique_ptr<texture>> &textures,
-                        CameraConfig &cam_config)
+                        CameraConfig &cam_config,
+                        const BVHBuildOptions &bvh_options,
+                        bool seeded_layout)
 {
 
   cam_config.position = vec3(0.0, 12.0, 35.0);
@@ -388,7 +407,115 @@ bvh_node *setup_scene_3(std::vector<std::unique_ptr<material>> &materials,
   for (auto *obj : scene)
     obj->bounding_box = obj->getBoundingBox();
 
-  bvh_node *root = new bvh_node(scene.data(), 0, scene.size());
+  // The cache key hashes the sphere bounds, which follow the seeded count, sizes and positions
+  BVHBuildStats stats;
+  Hittable *root = new linear_bvh(scene, seeded_scene_options(bvh_options, seeded_layout), &stats);
+  stats.print("scene 3");
+
+  for (auto &obj : scene)
+    obj = nullptr;
+
+  return root;
+}
+
+Hittable *setup_scene_4(std::vector<std::unique_ptr<material>> &materials,
+                        std::vector<std::unique_ptr<texture>> &textures,
+                        CameraConfig &cam_config,
+                        const BVHBuildOptions &bvh_options,
+                        bool seeded_layout)
+{
+
+  cam_config.position = vec3(0.0, 16.0, 62.0);
+  cam_config.look_at = vec3(0.0, 0.0, 0.0);
+  cam_config.up = vec3(0.0, -1.0, 0.0);
+  cam_config.fov = 60.0;
+  cam_config.aspect_ratio = 16.0 / 9.0;
+  cam_config.background_color = 1;
+
+  std::vector<Hittable *> scene;
+
+  auto gray_tex = std::make_unique<solid_color>(color(0.1, 0.1, 0.1));
+  auto lightGray_tex = std::make_unique<solid_color>(color(0.3, 0.3, 0.3));
+
+  auto checkered = std::make_unique<checker_texture>(4, lightGray_tex.get(), gray_tex.get());
+
+  auto *check_ptr = checkered.get();
+
+  textures.push_back(std::move(gray_tex));
+  textures.push_back(std::move(lightGray_tex));
+  textures.push_back(std::move(checkered));
+
+  auto check_mat = std::make_unique<lambertian>(*check_ptr, 0.0);
+  auto *check_m = check_mat.get();
+  materials.push_back(std::move(check_mat));
+
+  // A palette of vibrant diffuse colors plus a few metals for the instances to pick from
+  std::vector<material *> palette;
+  for (int i = 0; i < 8; ++i)
+  {
+    color col = color::hsv_to_rgb(i / 8.0, 0.9, 0.9);
+
+    auto solid_tex = std::make_unique<solid_color>(col);
+    texture *tex_ptr = solid_tex.get();
+    textures.push_back(std::move(solid_tex));
+
+    auto lambert_mat = std::make_unique<lambertian>(*tex_ptr, 0.0);
+    palette.push_back(lambert_mat.get());
+    materials.push_back(std::move(lambert_mat));
+  }
+  for (double fuzz : {0.0, 0.05, 0.2})
+  {
+    auto metal_mat = std::make_unique<metal>(color(0.9, 0.7, 0.3), 1.0, fuzz);
+    palette.push_back(metal_mat.get());
+    materials.push_back(std::move(metal_mat));
+  }
+
+  // One teapot and its BVH, placed over a grid many times through instances
+  const std::string obj_file = "./obj/teapot.obj";
+
+  try
+  {
+    MeshStats mesh_stats;
+    BVHBuildStats mesh_bvh_stats;
+    TriangleMesh *teapot = new TriangleMesh(TriangleMesh::load_obj(obj_file, palette[0], bvh_options, &mesh_stats, &mesh_bvh_stats));
+    mesh_stats.print(obj_file);
+    mesh_bvh_stats.print(obj_file);
+
+    const int rows = 32;
+    const int columns = 32;
+    const double spacing = 9.0;
+
+    for (int row = 0; row < rows; ++row)
+    {
+      for (int column = 0; column < columns; ++column)
+      {
+        double x = (column - (columns - 1) / 2.0) * spacing + Util::random_double_range(-2.0, 2.0);
+        double z = 40.0 - row * spacing + Util::random_double_range(-2.0, 2.0);
+        double yaw = Util::random_double_range(0.0, 360.0);
+        double size = Util::random_double_range(0.6, 1.3);
+
+        Transform placement = Transform::translate(vec3(x, 0.0, z)) * Transform::rotate(1, yaw) * Transform::scale(size);
+        material *mat = palette[Util::random_int(0, static_cast<int>(palette.size()) - 1)];
+        scene.push_back(new Instance(teapot, placement, mat));
+      }
+    }
+
+    std::cout << rows * columns << " instances of " << teapot->triangle_count() << " triangles" << std::endl;
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << "Error loading OBJ file: " << e.what() << std::endl;
+  }
+
+  scene.push_back(new Sphere(vec3(0.0, -2000, 0.0), 2000, check_m)); // Floor
+
+  for (auto *obj : scene)
+    obj->bounding_box = obj->getBoundingBox();
+
+  // The cache key hashes the instance bounds, which follow the seeded offsets, yaws and scales
+  BVHBuildStats stats;
+  Hittable *root = new linear_bvh(scene, seeded_scene_options(bvh_options, seeded_layout), &stats);
+  stats.print("scene 4");
 
   for (auto &obj : scene)
     obj = nullptr;
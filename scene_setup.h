@@ -7,13 +7,17 @@
 #include "hittable.h"
 #include "material.h"
 #include "bvh.h"
+#include "linear_bvh.h"
 #include "vec3.h"
 #include "color.h"
 #include "sphere.h"
 #include "quad.h"
 #include "triangle.h"
+#include "triangle_mesh.h"
 #include "texture.h"
 #include "hittable_list.h"
+#include "instance.h"
+#include "transform.h"
 #include "color.h"
 
 struct CameraConfig
@@ -26,17 +30,30 @@ struct CameraConfig
   int background_color;
 };
 
-// This function creates the scene and returns the BVH root node.
-bvh_node *setup_scene_1(std::vector<std::unique_ptr<material>> &materials,
+// This function creates the scene and returns the root of its acceleration structure.
+// bvh_options picks the builder (SAH for render quality, LBVH for fast startup) for the scene and its meshes,
+// and the BVH cache directory. Scenes 3 and 4 place their objects from the job seed; their scene BVH is cached only
+// when seeded_layout says the seed was chosen, since a random seed gives a layout no later run repeats.
+Hittable *setup_scene_1(std::vector<std::unique_ptr<material>> &materials,
                         std::vector<std::unique_ptr<texture>> &textures,
-                        CameraConfig &cam_config);
+                        CameraConfig &cam_config,
+                        const BVHBuildOptions &bvh_options = BVHBuildOptions());
 
-bvh_node *setup_scene_2(std::vector<std::unique_ptr<material>> &materials,
+Hittable *setup_scene_2(std::vector<std::unique_ptr<material>> &materials,
                         std::vector<std::unique_ptr<texture>> &textures,
-                        CameraConfig &cam_config);
+                        CameraConfig &cam_config,
+                        const BVHBuildOptions &bvh_options = BVHBuildOptions());
 
-bvh_node *setup_scene_3(std::vector<std::unique_ptr<material>> &materials,
+Hittable *setup_scene_3(std::vector<std::unique_ptr<material>> &materials,
                         std::vector<std::unique_ptr<texture>> &textures,
-                        CameraConfig &cam_config);
+                        CameraConfig &cam_config,
+                        const BVHBuildOptions &bvh_options = BVHBuildOptions(),
+                        bool seeded_layout = false);
+
+Hittable *setup_scene_4(std::vector<std::unique_ptr<material>> &materials,
+                        std::vector<std::unique_ptr<texture>> &textures,
+                        CameraConfig &cam_config,
+                        const BVHBuildOptions &bvh_options = BVHBuildOptions(),
+                        bool seeded_layout = false);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,120 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+// SSE2 is part of the x86-64 baseline, so SSE kernels build without extra flags. AVX2 kernels are
+// compiled per function with a target attribute and only called after the runtime check below.
+#if defined(__x86_64__) || defined(_M_X64)
+#define RT_SIMD_SSE 1
+#include <immintrin.h>
+#if defined(__GNUC__)
+#define RT_SIMD_AVX2 1
+#define RT_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+#endif
+
+enum class SIMDLevel
+{
+  scalar = 0,
+  sse = 1,
+  avx2 = 2
+};
+
+class SIMD
+{
+public:
+  // Best instruction set this CPU supports. Setting RT_SIMD=scalar|sse|avx2 caps it, which is
+  // handy for comparing kernels or reproducing a fallback path on a newer machine.
+  static SIMDLevel level()
+  {
+    static SIMDLevel cached = detect();
+    return cached;
+  }
+
+  static const char *name(SIMDLevel level)
+  {
+    switch (level)
+    {
+    case SIMDLevel::avx2:
+      return "avx2";
+    case SIMDLevel::sse:
+      return "sse";
+    default:
+      return "scalar";
+    }
+  }
+
+private:
+  static SIMDLevel detect()
+  {
+    SIMDLevel supported = SIMDLevel::scalar;
+#if defined(RT_SIMD_SSE)
+    supported = SIMDLevel::sse;
+#endif
+#if defined(RT_SIMD_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      supported = SIMDLevel::avx2;
+#endif
+
+    const char *cap = std::getenv("RT_SIMD");
+    if (cap != nullptr)
+    {
+      SIMDLevel requested = supported;
+      if (std::strcmp(cap, "scalar") == 0)
+        requested = SIMDLevel::scalar;
+      else if (std::strcmp(cap, "sse") == 0)
+        requested = SIMDLevel::sse;
+      else if (std::strcmp(cap, "avx2") == 0)
+        requested = SIMDLevel::avx2;
+
+      if (requested < supported)
+        supported = requested;
+    }
+    return supported;
+  }
+};
+
+// Allocator for std::vector of SIMD structs declared alignas(32). Before C++17, operator new only
+// guarantees alignof(std::max_align_t), usually 16 bytes, so the compiler's aligned loads and
+// stores of such elements could fault. Over-allocates and keeps the malloc pointer just before the
+// block.
+template <typename T>
+struct AlignedAllocator
+{
+  typedef T value_type;
+
+  AlignedAllocator() = default;
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U> &) {}
+
+  T *allocate(size_t n)
+  {
+    const size_t alignment = alignof(T) > alignof(void *) ? alignof(T) : alignof(void *);
+    void *block = std::malloc(n * sizeof(T) + alignment + sizeof(void *));
+    if (!block)
+      throw std::bad_alloc();
+    uintptr_t start = reinterpret_cast<uintptr_t>(block) + sizeof(void *);
+    void **aligned = reinterpret_cast<void **>((start + alignment - 1) / alignment * alignment);
+    aligned[-1] = block;
+    return reinterpret_cast<T *>(aligned);
+  }
+
+  void deallocate(T *p, size_t)
+  {
+    if (p)
+      std::free(reinterpret_cast<void **>(p)[-1]);
+  }
+
+  template <typename U>
+  bool operator==(const AlignedAllocator<U> &) const { return true; }
+  template <typename U>
+  bool operator!=(const AlignedAllocator<U> &) const { return false; }
+};
+
+#endif // SIMD_H
\ No newline at end of file
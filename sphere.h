@@ -103,28 +103,27 @@ class Sphere : public Hittable
 {
 public:
     vec3 center;   // Center of the sphere
-    double radius; // Radius of the sphere
+    real radius; // Radius of the sphere
     material *mat;
 
     // Constructor to initialize the sphere with a center, radius, and reflectivity
-    Sphere(const vec3 &center, double radius, material *mat)
+    Sphere(const vec3 &center, real radius, material *mat)
         : center(center), radius(radius), mat(mat) {}
-    // Override the hit() method from Hittable
-    bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override
+    bool intersect(const ray &r, real t_min, real t_max, hit_record &rec) const override
     {
         vec3 oc = r.origin - center;
         // std::cout << oc << std::endl;
         //   oc was -1, 2, 9
-        double a = r.direction.length_squared();
-        double h = vec3::dot(r.direction, oc);
-        double c = oc.length_squared() - radius * radius;
+        real a = r.direction.length_squared();
+        real h = vec3::dot(r.direction, oc);
+        real c = oc.length_squared() - radius * radius;
 
-        double discriminant = h * h - a * c;
+        real discriminant = h * h - a * c;
         if (discriminant < 0)
             return false;
 
-        double sqrt_disc = std::sqrt(discriminant);
-        double t = (-h - sqrt_disc) / a; // Nearest root
+        real sqrt_disc = std::sqrt(discriminant);
+        real t = (-h - sqrt_disc) / a; // Nearest root
 
         if (t < t_min || t > t_max)
         {
@@ -132,18 +131,37 @@ public:
             if (t < t_min || t > t_max)
                 return false;
         }
-        // vec3 outward_normal = (rec.p - center) * (1.0 / radius);
 
         rec.t = t;
-        rec.p = r.at(t);
+        rec.object = this;
+        return true;
+    }
+
+    void finalize_hit(const ray &r, hit_record &rec) const override
+    {
+        rec.p = r.at(rec.t);
         vec3 outward_normal = (rec.p - center) * (1.0 / radius);
         // std::cout << outward_normal << std::endl;
         get_sphere_uv(outward_normal, rec.u, rec.v);
-        rec.normal = outward_normal;
         rec.set_face_normal(r, outward_normal);
         rec.mat = mat;
+    }
 
-        return true;
+    bool occluded(const ray &r, real t_min, real t_max) const override
+    {
+        vec3 oc = r.origin - center;
+        real a = r.direction.length_squared();
+        real h = vec3::dot(r.direction, oc);
+        real c = oc.length_squared() - radius * radius;
+
+        real discriminant = h * h - a * c;
+        if (discriminant < 0)
+            return false;
+
+        real sqrt_disc = std::sqrt(discriminant);
+        real t_near = (-h - sqrt_disc) / a;
+        real t_far = (-h + sqrt_disc) / a;
+        return (t_near >= t_min && t_near <= t_max) || (t_far >= t_min && t_far <= t_max);
     }
 
     AABB getBoundingBox() const override
@@ -153,12 +171,12 @@ public:
         return AABB(min, max);
     }
 
-    static void get_sphere_uv(const vec3 &p, double &u, double &v)
+    static void get_sphere_uv(const vec3 &p, real &u, real &v)
     {
-        double pi = 3.14159;
+        real pi = 3.14159;
 
-        double theta = std::acos(-p.y);
-        double phi = std::atan2(-p.z, p.x) + pi;
+        real theta = std::acos(-p.y);
+        real phi = std::atan2(-p.z, p.x) + pi;
 
         u = phi / (2 * pi);
         v = theta / pi;
@@ -0,0 +1,258 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Size and placement of a thread pool
+struct ThreadPoolOptions
+{
+  unsigned threads = 0;  // Threads including the caller, 0 for one per hardware thread (or per listed CPU)
+  std::vector<int> cpus; // CPUs to pin the threads to, round robin; empty to leave placement to the OS
+
+  // Options from RT_THREADS (a thread count) and RT_CPUS (a CPU list such as "0-3,8-11")
+  static ThreadPoolOptions from_environment()
+  {
+    ThreadPoolOptions options;
+    if (const char *threads = std::getenv("RT_THREADS"))
+      parse_threads(threads, options.threads);
+    if (const char *cpus = std::getenv("RT_CPUS"))
+      parse_cpus(cpus, options.cpus);
+    return options;
+  }
+
+  // Parse a positive thread count. Returns false, leaving threads alone, for anything else.
+  static bool parse_threads(const std::string &text, unsigned &threads)
+  {
+    char *end = nullptr;
+    long value = std::strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || value <= 0)
+      return false;
+    threads = static_cast<unsigned>(value);
+    return true;
+  }
+
+  // Parse a comma-separated list of CPUs and CPU ranges, e.g. "0-3,8,10-11", the format of
+  // taskset and of /sys/devices/system/node/node*/cpulist. Returns false, leaving cpus alone, if
+  // the list is malformed.
+  static bool parse_cpus(const std::string &text, std::vector<int> &cpus)
+  {
+    std::vector<int> parsed;
+    size_t start = 0;
+    while (start <= text.size())
+    {
+      size_t comma = text.find(',', start);
+      std::string range = text.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+      char *end = nullptr;
+      long first = std::strtol(range.c_str(), &end, 10);
+      long last = first;
+      if (*end == '-')
+        last = std::strtol(end + 1, &end, 10);
+      if (range.empty() || *end != '\0' || first < 0 || last < first)
+        return false;
+      for (long cpu = first; cpu <= last; ++cpu)
+        parsed.push_back(static_cast<int>(cpu));
+      if (comma == std::string::npos)
+        break;
+      start = comma + 1;
+    }
+    cpus = parsed;
+    return true;
+  }
+};
+
+// Fixed set of worker threads that runs parallel loops for the BVH builders, the OBJ parser and
+// the renderer. The workers are started once and sleep between loops, so a multi-frame job pays
+// for thread creation only once, and the thread count set at startup bounds every stage.
+class ThreadPool
+{
+public:
+  explicit ThreadPool(const ThreadPoolOptions &options = ThreadPoolOptions()) : cpus(options.cpus)
+  {
+    unsigned threads = options.threads;
+    if (threads == 0)
+      threads = !cpus.empty() ? static_cast<unsigned>(cpus.size()) : std::max(1u, std::thread::hardware_concurrency());
+
+    // The calling thread is thread 0 and runs its share of every loop
+    for (unsigned t = 1; t < threads; ++t)
+      workers.emplace_back(&ThreadPool::work, this, t);
+  }
+
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers)
+      worker.join();
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Threads that work on a loop, the caller included
+  unsigned size() const { return static_cast<unsigned>(workers.size()) + 1; }
+
+  // Run fn(i) for every i in [0, count) on up to `threads` threads (the caller is one of them),
+  // each pulling the next index from a shared counter. Called from inside a loop, it runs
+  // serially on the calling thread. Loops from different threads take turns.
+  void parallel_for(size_t count, unsigned threads, const std::function<void(size_t)> &fn)
+  {
+    size_t thread_count = std::min<size_t>(std::min(threads, size()), count);
+    if (thread_count <= 1 || inside_loop())
+    {
+      for (size_t i = 0; i < count; ++i)
+        fn(i);
+      return;
+    }
+
+    std::lock_guard<std::mutex> turn(submit);
+    Loop loop(fn, count);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      current = &loop;
+      open_slots = static_cast<unsigned>(thread_count - 1);
+      ++generation;
+    }
+    wake.notify_all();
+
+    run(loop);
+
+    // Close the loop to workers that have not picked it up yet, then wait for the rest
+    std::unique_lock<std::mutex> lock(mutex);
+    open_slots = 0;
+    finished.wait(lock, [&]
+                  { return running == 0; });
+    current = nullptr;
+  }
+
+  // Pin the calling thread to the first of the pool's CPUs, if any are set
+  void pin_caller() const
+  {
+    if (!cpus.empty())
+      pin(cpus[0]);
+  }
+
+  // The pool every parallel stage of the renderer shares. Created on first use from
+  // ThreadPoolOptions::from_environment() unless configure() was called before.
+  static ThreadPool &shared()
+  {
+    std::unique_ptr<ThreadPool> &pool = shared_slot();
+    if (!pool)
+      pool.reset(new ThreadPool(ThreadPoolOptions::from_environment()));
+    return *pool;
+  }
+
+  // Replace the shared pool, pinning the calling thread as its thread 0. Must not be called while
+  // a loop is running on it.
+  static void configure(const ThreadPoolOptions &options)
+  {
+    std::unique_ptr<ThreadPool> &pool = shared_slot();
+    pool.reset();
+    pool.reset(new ThreadPool(options));
+    pool->pin_caller();
+  }
+
+private:
+  struct Loop
+  {
+    const std::function<void(size_t)> &fn;
+    size_t count;
+    std::atomic<size_t> next{0};
+
+    Loop(const std::function<void(size_t)> &fn, size_t count) : fn(fn), count(count) {}
+  };
+
+  std::vector<std::thread> workers;
+  std::vector<int> cpus;
+
+  std::mutex submit; // Held by the thread whose loop is running
+  std::mutex mutex;  // Guards everything below
+  std::condition_variable wake;
+  std::condition_variable finished;
+  Loop *current = nullptr;
+  unsigned open_slots = 0; // Workers that may still join the current loop
+  unsigned running = 0;    // Workers inside the current loop
+  unsigned long long generation = 0;
+  bool stopping = false;
+
+  static std::unique_ptr<ThreadPool> &shared_slot()
+  {
+    static std::unique_ptr<ThreadPool> pool;
+    return pool;
+  }
+
+  // True on a thread that is running a loop's body
+  static bool &inside_loop()
+  {
+    static thread_local bool inside = false;
+    return inside;
+  }
+
+  static void run(Loop &loop)
+  {
+    inside_loop() = true;
+    for (size_t i = loop.next++; i < loop.count; i = loop.next++)
+      loop.fn(i);
+    inside_loop() = false;
+  }
+
+  static void pin(int cpu)
+  {
+#if defined(__linux__)
+    if (cpu >= CPU_SETSIZE)
+      return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu;
+#endif
+  }
+
+  void work(unsigned index)
+  {
+    if (!cpus.empty())
+      pin(cpus[index % cpus.size()]);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    unsigned long long seen = generation;
+    for (;;)
+    {
+      wake.wait(lock, [&]
+                { return stopping || generation != seen; });
+      if (stopping)
+        return;
+      seen = generation;
+      if (open_slots == 0)
+        continue;
+
+      --open_slots;
+      ++running;
+      Loop *loop = current;
+      lock.unlock();
+      run(*loop);
+      lock.lock();
+      if (--running == 0)
+        finished.notify_all();
+    }
+  }
+};
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,147 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Order the tiles of an image are handed out in. Along the Hilbert and Morton curves consecutive
+// tiles are neighbours on screen, so threads working on nearby tiles share the BVH nodes and
+// textures they touch.
+enum class TileOrder
+{
+  scanline,
+  morton,
+  hilbert
+};
+
+// Pixel rectangle [x0, x1) x [y0, y1)
+struct Tile
+{
+  int x0, y0, x1, y1;
+};
+
+// Splits an image into square tiles and hands them to render threads one at a time through an
+// atomic counter. A thread that finishes a cheap tile simply takes the next one, so expensive
+// regions of the frame no longer leave the other threads idle at the end.
+class TileScheduler
+{
+public:
+  TileScheduler(int width, int height, int tile_size, TileOrder order)
+  {
+    tile_size = std::max(tile_size, 1);
+    int tiles_x = (width + tile_size - 1) / tile_size;
+    int tiles_y = (height + tile_size - 1) / tile_size;
+
+    // Side of the smallest power-of-two grid covering the tiles, for the curve indices
+    uint32_t grid = 1;
+    while (grid < static_cast<uint32_t>(std::max(tiles_x, tiles_y)))
+      grid *= 2;
+
+    std::vector<std::pair<uint64_t, Tile>> ordered;
+    ordered.reserve(static_cast<size_t>(tiles_x) * tiles_y);
+    for (int ty = 0; ty < tiles_y; ++ty)
+    {
+      for (int tx = 0; tx < tiles_x; ++tx)
+      {
+        Tile tile{tx * tile_size, ty * tile_size, std::min((tx + 1) * tile_size, width), std::min((ty + 1) * tile_size, height)};
+        uint64_t index = static_cast<uint64_t>(ty) * tiles_x + tx;
+        if (order == TileOrder::morton)
+          index = morton_index(tx, ty);
+        else if (order == TileOrder::hilbert)
+          index = hilbert_index(grid, tx, ty);
+        ordered.push_back(std::make_pair(index, tile));
+      }
+    }
+    std::sort(ordered.begin(), ordered.end(), [](const std::pair<uint64_t, Tile> &a, const std::pair<uint64_t, Tile> &b)
+              { return a.first < b.first; });
+
+    tiles.reserve(ordered.size());
+    for (const auto &entry : ordered)
+      tiles.push_back(entry.second);
+  }
+
+  size_t size() const { return tiles.size(); }
+
+  // Claim the next unrendered tile. Returns false once every tile has been handed out.
+  bool next(Tile &tile)
+  {
+    size_t index = next_tile.fetch_add(1, std::memory_order_relaxed);
+    if (index >= tiles.size())
+      return false;
+    tile = tiles[index];
+    return true;
+  }
+
+  static const char *name(TileOrder order)
+  {
+    switch (order)
+    {
+    case TileOrder::morton:
+      return "morton";
+    case TileOrder::hilbert:
+      return "hilbert";
+    default:
+      return "scanline";
+    }
+  }
+
+  // Parse "scanline", "morton" or "hilbert". Returns false, leaving order alone, for anything else.
+  static bool parse(const std::string &text, TileOrder &order)
+  {
+    for (TileOrder candidate : {TileOrder::scanline, TileOrder::morton, TileOrder::hilbert})
+    {
+      if (text == name(candidate))
+      {
+        order = candidate;
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  std::vector<Tile> tiles;
+  std::atomic<size_t> next_tile{0};
+
+  // Interleave the bits of x and y, x in the even bits
+  static uint64_t morton_index(uint32_t x, uint32_t y)
+  {
+    uint64_t index = 0;
+    for (int bit = 0; bit < 32; ++bit)
+    {
+      index |= static_cast<uint64_t>((x >> bit) & 1) << (2 * bit);
+      index |= static_cast<uint64_t>((y >> bit) & 1) << (2 * bit + 1);
+    }
+    return index;
+  }
+
+  // Distance of (x, y) along the Hilbert curve filling a grid x grid square, grid a power of two
+  static uint64_t hilbert_index(uint32_t grid, uint32_t x, uint32_t y)
+  {
+    uint64_t index = 0;
+    for (uint32_t s = grid / 2; s > 0; s /= 2)
+    {
+      uint32_t rx = (x & s) > 0;
+      uint32_t ry = (y & s) > 0;
+      index += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+
+      // Rotate the quadrant so the curve inside it starts and ends where its neighbours meet it
+      if (ry == 0)
+      {
+        if (rx == 1)
+        {
+          x = grid - 1 - x;
+          y = grid - 1 - y;
+        }
+        std::swap(x, y);
+      }
+    }
+    return index;
+  }
+};
+
+#endif // TILE_SCHEDULER_H
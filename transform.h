@@ -0,0 +1,129 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "aabb.h"
+#include "ray.h"
+#include "vec3.h"
+#include <cmath>
+
+// Affine transform p' = m * p + t. Transforms compose right to left like matrices:
+// (a * b).point(p) == a.point(b.point(p)).
+class Transform
+{
+public:
+  real m[3][3];
+  vec3 t;
+
+  Transform() : m{{1, 0, 0}, {0, 1, 0}, {0, 0, 1}}, t(0, 0, 0) {}
+
+  static Transform translate(const vec3 &offset)
+  {
+    Transform x;
+    x.t = offset;
+    return x;
+  }
+
+  static Transform scale(const vec3 &s)
+  {
+    Transform x;
+    x.m[0][0] = s.x;
+    x.m[1][1] = s.y;
+    x.m[2][2] = s.z;
+    return x;
+  }
+
+  static Transform scale(real s) { return scale(vec3(s, s, s)); }
+
+  // Rotation by `degrees` about the x, y or z axis
+  static Transform rotate(int axis, real degrees)
+  {
+    real radians = degrees * 3.14159265358979323846 / 180.0;
+    real c = std::cos(radians), s = std::sin(radians);
+    int u = (axis + 1) % 3, v = (axis + 2) % 3;
+
+    Transform x;
+    x.m[u][u] = c;
+    x.m[u][v] = -s;
+    x.m[v][u] = s;
+    x.m[v][v] = c;
+    return x;
+  }
+
+  Transform operator*(const Transform &other) const
+  {
+    Transform x;
+    for (int r = 0; r < 3; ++r)
+      for (int c = 0; c < 3; ++c)
+        x.m[r][c] = m[r][0] * other.m[0][c] + m[r][1] * other.m[1][c] + m[r][2] * other.m[2][c];
+    x.t = point(other.t);
+    return x;
+  }
+
+  // Inverse through the adjugate. The matrix must not be singular (no zero scale).
+  Transform inverse() const
+  {
+    Transform x;
+    x.m[0][0] = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    x.m[0][1] = m[0][2] * m[2][1] - m[0][1] * m[2][2];
+    x.m[0][2] = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+    x.m[1][0] = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    x.m[1][1] = m[0][0] * m[2][2] - m[0][2] * m[2][0];
+    x.m[1][2] = m[0][2] * m[1][0] - m[0][0] * m[1][2];
+    x.m[2][0] = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    x.m[2][1] = m[0][1] * m[2][0] - m[0][0] * m[2][1];
+    x.m[2][2] = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+
+    real inv_det = 1.0 / (m[0][0] * x.m[0][0] + m[0][1] * x.m[1][0] + m[0][2] * x.m[2][0]);
+    for (int r = 0; r < 3; ++r)
+      for (int c = 0; c < 3; ++c)
+        x.m[r][c] *= inv_det;
+
+    x.t = x.vector(t) * -1.0;
+    return x;
+  }
+
+  vec3 vector(const vec3 &v) const
+  {
+    return vec3(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+  }
+
+  vec3 point(const vec3 &p) const { return vector(p) + t; }
+
+  // Multiply by the transposed matrix. Called on the inverse transform, this carries normals
+  // across, since normals transform with the inverse transpose.
+  vec3 transpose_vector(const vec3 &v) const
+  {
+    return vec3(m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+                m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+                m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z);
+  }
+
+  // The direction is not renormalized, so hit distances are the same on both sides
+  ray apply(const ray &r) const
+  {
+    return ray(point(r.origin), vector(r.direction), r.time());
+  }
+
+  // Tight box around the transformed box (Arvo's method): each output extent picks, per matrix
+  // entry, whichever input extent gives the smaller and larger product
+  AABB box(const AABB &b) const
+  {
+    real lo[3] = {t.x, t.y, t.z};
+    real hi[3] = {t.x, t.y, t.z};
+    for (int r = 0; r < 3; ++r)
+    {
+      for (int c = 0; c < 3; ++c)
+      {
+        real e0 = m[r][c] * b.min[c];
+        real e1 = m[r][c] * b.max[c];
+        lo[r] += std::fmin(e0, e1);
+        hi[r] += std::fmax(e0, e1);
+      }
+    }
+    return AABB(vec3(lo[0], lo[1], lo[2]), vec3(hi[0], hi[1], hi[2]));
+  }
+};
+
+#endif // TRANSFORM_H
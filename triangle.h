@@ -13,63 +13,79 @@ class Triangle : public Hittable
 public:
   // Vertices of the triangle
   vec3 a, b, c;
+  // Edges from a and the unit normal, computed once so hit() only does the ray-dependent work
+  vec3 e1, e2;
+  vec3 n;
   material *mat;
   // double reflectivity;
 
   // Constructor to initialize the triangle with vertices and reflectivity
   Triangle(const vec3 &v1, const vec3 &v2, const vec3 &v3, material *mat)
-      : a(v1), b(v2), c(v3), mat(mat) {}
+      : a(v1), b(v2), c(v3), e1(v2 - v1), e2(v3 - v1), n(vec3::unit_vector(vec3::cross(e1, e2))), mat(mat) {}
 
-  // Function to compute the normal vector of the triangle's surface
-  vec3 normal() const
+  // Unit normal of the triangle's surface, wound counter-clockwise from a to b to c
+  const vec3 &normal() const { return n; }
+
+  bool intersect(const ray &r, real t_min, real t_max, hit_record &rec) const override
+  {
+    real t;
+    if (!intersect(a, e1, e2, r, t_min, t_max, t))
+      return false;
+
+    rec.t = t;
+    rec.object = this;
+    return true;
+  }
+
+  void finalize_hit(const ray &r, hit_record &rec) const override
   {
-    vec3 ab = vec3::sub(b, a);                      // ab = b - a
-    vec3 ac = vec3::sub(c, a);                      // ac = c - a
-    vec3 cross_product = vec3::cross(ab, ac);       // cross(ab, ac)
-    vec3 normal = vec3::unit_vector(cross_product); // Normalize the cross product to get the normal
-    return normal;
+    rec.p = r.at(rec.t);
+    rec.set_face_normal(r, n); // Use the triangle's normal
+    rec.mat = mat;
   }
 
-  bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override
+  // Same test as intersect() without recording the hit
+  bool occluded(const ray &r, real t_min, real t_max) const override
+  {
+    real t;
+    return intersect(a, e1, e2, r, t_min, t_max, t);
+  }
+
+  AABB getBoundingBox() const override
+  {
+    return bounds(a, b, c);
+  }
+
+  // Moller-Trumbore ray/triangle test on vertex a and edges e1 = b - a, e2 = c - a, shared with
+  // TriangleMesh. Sets t on a hit in [t_min, t_max].
+  static bool intersect(const vec3 &a, const vec3 &e1, const vec3 &e2, const ray &r, real t_min, real t_max, real &t)
   {
-    vec3 e1 = b - a;
-    vec3 e2 = c - a;
     vec3 h = vec3::cross(r.direction, e2);
-    double z = vec3::dot(e1, h);
+    real z = vec3::dot(e1, h);
 
-    if (z > -1e-8 && z < 1e-8)
+    if (Precision::parallel(z, e1.length_squared() * h.length_squared()))
     {
       return false; // Ray is parallel to the triangle
     }
 
-    double f = 1.0 / z;
+    real f = 1.0 / z;
     vec3 s = r.origin - a;
-    double u = f * vec3::dot(s, h);
+    real u = f * vec3::dot(s, h);
 
     if (u < 0.0 || u > 1.0)
       return false;
 
     vec3 q = vec3::cross(s, e1);
-    double v = f * vec3::dot(r.direction, q);
+    real v = f * vec3::dot(r.direction, q);
 
     if (v < 0.0 || u + v > 1.0)
       return false;
 
-    double t = f * vec3::dot(e2, q);
-    if (t < t_min || t > t_max)
-      return false;
-
-    // If we are here, there was a valid intersection
-
-    rec.t = t;
-    rec.p = r.at(t);
-    rec.normal = normal(); // Use the triangle's normal
-    rec.set_face_normal(r, normal());
-    rec.mat = mat;
-    return true;
+    t = f * vec3::dot(e2, q);
+    return t >= t_min && t <= t_max;
   }
 
-  AABB getBoundingBox() const override
+  static AABB bounds(const vec3 &a, const vec3 &b, const vec3 &c)
   {
     // Find the minimum and maximum corners of the triangle
     vec3 min = vec3::min(vec3::min(a, b), c);
@@ -0,0 +1,261 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "bvh.h"
+#include "hittable.h"
+#include "linear_bvh.h"
+#include "mapped_file.h"
+#include "mesh_cache.h"
+#include "obj_parser.h"
+#include "simd.h"
+#include "triangle.h"
+#include "triangle_packet.h"
+#include "vec3.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Triangle mesh with one shared vertex buffer and an index buffer of three vertex indices per
+// triangle. Its BVH references triangles by index, so each triangle costs 12 bytes of indices,
+// its share of the vertices and its precomputed edges and normal, instead of a heap-allocated
+// Triangle with six vec3 of its own.
+// With SSE or AVX2 the leaves also keep their triangles in 4- or 8-wide packets, and one SIMD
+// test against a packet leaves only the likely hits for the exact test. The buffers may be owned
+// or mapped straight from an .rtmesh cache file.
+class TriangleMesh : public Hittable
+{
+public:
+  MeshBuffer<vec3> vertices;
+  MeshBuffer<uint32_t> indices; // Three per triangle, in BVH leaf order once the mesh is built
+  material *mat;
+
+  TriangleMesh(MeshBuffer<vec3> vertices, MeshBuffer<uint32_t> indices, material *mat,
+               const BVHBuildOptions &options = BVHBuildOptions(), BVHBuildStats *stats = nullptr)
+      : vertices(std::move(vertices)), indices(std::move(indices)), mat(mat)
+  {
+    build(options, stats);
+  }
+
+  // Edges from the first vertex and the unit normal of a triangle, computed once like Triangle's
+  struct Frame
+  {
+    vec3 e1, e2;
+    vec3 n;
+  };
+
+  size_t triangle_count() const { return indices.size() / 3; }
+
+  bool intersect(const ray &r, real t_min, real t_max, hit_record &rec) const override
+  {
+    uint32_t closest_triangle = 0;
+    real closest_t = t_max;
+    auto exact = [&](uint32_t i, real &closest)
+    {
+      real t;
+      if (!Triangle::intersect(vertex(i, 0), frames[i].e1, frames[i].e2, r, t_min, closest, t))
+        return false;
+      closest = t;
+      closest_t = t;
+      closest_triangle = i;
+      return true;
+    };
+
+    bool hit_anything;
+    if (packet_width != 0)
+    {
+      const PacketRay pr(r);
+      auto leaf = [&](uint32_t first, uint32_t count, real &closest)
+      {
+        if (packet_width == 8)
+          return packets8.intersect(first, count, pr, t_min, closest, false, exact);
+        return packets4.intersect(first, count, pr, t_min, closest, false, exact);
+      };
+      hit_anything = accel.intersect(r, t_min, t_max, leaf);
+    }
+    else
+    {
+      auto leaf = [&](uint32_t first, uint32_t count, real &closest)
+      {
+        bool hit_leaf = false;
+        for (uint32_t i = first; i < first + count; ++i)
+          hit_leaf |= exact(i, closest);
+        return hit_leaf;
+      };
+      hit_anything = accel.intersect(r, t_min, t_max, leaf);
+    }
+    if (!hit_anything)
+      return false;
+
+    rec.t = closest_t;
+    rec.object = this;
+    rec.primitive = closest_triangle;
+    return true;
+  }
+
+  void finalize_hit(const ray &r, hit_record &rec) const override
+  {
+    rec.p = r.at(rec.t);
+    rec.set_face_normal(r, frames[rec.primitive].n);
+    rec.mat = mat;
+  }
+
+  bool occluded(const ray &r, real t_min, real t_max) const override
+  {
+    auto exact = [&](uint32_t i, real &)
+    {
+      real t;
+      return Triangle::intersect(vertex(i, 0), frames[i].e1, frames[i].e2, r, t_min, t_max, t);
+    };
+
+    if (packet_width != 0)
+    {
+      const PacketRay pr(r);
+      auto leaf = [&](uint32_t first, uint32_t count)
+      {
+        real far = t_max;
+        if (packet_width == 8)
+          return packets8.intersect(first, count, pr, t_min, far, true, exact);
+        return packets4.intersect(first, count, pr, t_min, far, true, exact);
+      };
+      return accel.intersect_any(r, t_min, t_max, leaf);
+    }
+
+    auto leaf = [&](uint32_t first, uint32_t count)
+    {
+      real far = t_max;
+      for (uint32_t i = first; i < first + count; ++i)
+      {
+        if (exact(i, far))
+          return true;
+      }
+      return false;
+    };
+    return accel.intersect_any(r, t_min, t_max, leaf);
+  }
+
+  AABB getBoundingBox() const override { return bbox; }
+
+  // Read the vertices and faces of an OBJ file into one mesh. The file is parsed once, on
+  // bvh_options.threads threads like the BVH build that follows; the counts, bounds and timings
+  // of both steps go to the stats pointers that are given. Unless RT_MESH_CACHE=off, the parsed
+  // buffers are saved to <filename>.rtmesh, and later loads of the unchanged file map that instead.
+  static TriangleMesh load_obj(const std::string &filename, material *mat,
+                               const BVHBuildOptions &bvh_options = BVHBuildOptions(),
+                               MeshStats *mesh_stats = nullptr, BVHBuildStats *bvh_stats = nullptr)
+  {
+    auto load_start = std::chrono::steady_clock::now();
+    MeshStats local_stats;
+    MeshStats &stats = mesh_stats ? *mesh_stats : local_stats;
+
+    MappedFile source(filename);
+    if (!source.is_open())
+      throw std::runtime_error("Could not open OBJ file");
+
+    MeshBuffer<vec3> vertices;
+    MeshBuffer<uint32_t> indices;
+    if (MeshCache::enabled())
+    {
+      const std::string cache_path = MeshCache::path(filename);
+      const MeshCacheKey key = MeshCacheKey::of(source);
+      if (MeshCache::load(cache_path, key, vertices, indices, &stats))
+        stats.cache = "hit";
+      else
+      {
+        ObjMesh obj = ObjParser::parse(source, bvh_options.threads, &stats);
+        if (MeshCache::store(cache_path, key, obj, stats))
+          stats.cache = "written";
+        vertices = std::move(obj.vertices);
+        indices = std::move(obj.indices);
+      }
+    }
+    else
+    {
+      ObjMesh obj = ObjParser::parse(source, bvh_options.threads, &stats);
+      vertices = std::move(obj.vertices);
+      indices = std::move(obj.indices);
+    }
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - load_start;
+    stats.load_ms = elapsed.count();
+    return TriangleMesh(std::move(vertices), std::move(indices), mat, bvh_options, bvh_stats);
+  }
+
+private:
+  PrimitiveBVH accel;
+  std::vector<Frame> frames; // Per triangle, in leaf order like the indices
+  TrianglePackets<4> packets4;
+  TrianglePackets<8> packets8;
+  int packet_width = 0; // 4 or 8, or 0 to test the leaf triangles one at a time
+  AABB bbox;
+
+  // Packet width for this CPU: 8 with AVX2, 4 with SSE, 0 without SIMD
+  static int preferred_packet_width()
+  {
+    SIMDLevel level = SIMD::level();
+    if (level == SIMDLevel::avx2)
+      return 8;
+    if (level == SIMDLevel::sse)
+      return 4;
+    return 0;
+  }
+
+  const vec3 &vertex(size_t triangle, int corner) const
+  {
+    return vertices[indices[3 * triangle + corner]];
+  }
+
+  void build(const BVHBuildOptions &options, BVHBuildStats *stats)
+  {
+    std::vector<AABB> prim_bounds;
+    prim_bounds.reserve(triangle_count());
+    for (size_t i = 0; i < triangle_count(); ++i)
+      prim_bounds.push_back(Triangle::bounds(vertex(i, 0), vertex(i, 1), vertex(i, 2)));
+
+    // A packet tests its triangles for the price of one, so leaves may grow to a full packet
+    packet_width = preferred_packet_width();
+    BVHBuildOptions mesh_options = options;
+    if (packet_width != 0)
+    {
+      mesh_options.max_leaf_size = std::max(options.max_leaf_size, packet_width);
+      mesh_options.leaf_cost_threshold = std::max(options.leaf_cost_threshold, packet_width * options.intersection_cost);
+    }
+    accel.build(prim_bounds, mesh_options, stats);
+
+    // Store the triangles in leaf order, so a leaf's triangles are one contiguous run of indices
+    std::vector<uint32_t> ordered;
+    ordered.reserve(indices.size());
+    for (uint32_t prim : accel.prim_order())
+      ordered.insert(ordered.end(), indices.begin() + 3 * prim, indices.begin() + 3 * prim + 3);
+    indices = std::move(ordered);
+
+    // Built here rather than stored in the .rtmesh cache: a cache hit still runs the BVH build,
+    // which reorders the triangles, and the frames take one pass over data already in cache
+    frames.resize(triangle_count());
+    for (size_t i = 0; i < triangle_count(); ++i)
+    {
+      const vec3 &a = vertex(i, 0);
+      frames[i].e1 = vertex(i, 1) - a;
+      frames[i].e2 = vertex(i, 2) - a;
+      frames[i].n = vec3::unit_vector(vec3::cross(frames[i].e1, frames[i].e2));
+    }
+
+    auto triangle = [&](size_t i, vec3 &a, vec3 &e1, vec3 &e2)
+    {
+      a = vertex(i, 0);
+      e1 = frames[i].e1;
+      e2 = frames[i].e2;
+    };
+    if (packet_width == 8)
+      packets8.build(accel.binary(), triangle_count(), triangle);
+    else if (packet_width == 4)
+      packets4.build(accel.binary(), triangle_count(), triangle);
+
+    bbox = accel.bounds();
+    bounding_box = bbox;
+  }
+};
+
+#endif // TRIANGLE_MESH_H
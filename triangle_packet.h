@@ -0,0 +1,371 @@
+#ifndef TRIANGLE_PACKET_H
+#define TRIANGLE_PACKET_H
+
+#include "flat_bvh.h"
+#include "ray.h"
+#include "simd.h"
+#include "vec3.h"
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// N triangles of one BVH leaf stored structure-of-arrays: a vertex and the two edges from it,
+// one float lane per triangle, so a single Moller-Trumbore kernel tests all of them. Vertices are
+// stored relative to a double-precision anchor inside the packet, so float precision follows the
+// size of the triangles rather than their distance from the world origin. The L1 norms of each
+// lane's vectors bound the kernels' rounding error. Unused lanes have zero edges, which no kernel
+// reports.
+template <int N>
+struct alignas(32) TrianglePacket
+{
+  float v0[3][N];
+  float e1[3][N];
+  float e2[3][N];
+  float v0_norm[N];
+  float e1_norm[N];
+  float e2_norm[N];
+  double anchor[3];
+
+  void set(int lane, const vec3 &a, const vec3 &edge1, const vec3 &edge2)
+  {
+    v0_norm[lane] = e1_norm[lane] = e2_norm[lane] = 0.0f;
+    for (int k = 0; k < 3; ++k)
+    {
+      v0[k][lane] = static_cast<float>(a[k] - anchor[k]);
+      e1[k][lane] = static_cast<float>(edge1[k]);
+      e2[k][lane] = static_cast<float>(edge2[k]);
+      v0_norm[lane] += std::fabs(v0[k][lane]);
+      e1_norm[lane] += std::fabs(e1[k][lane]);
+      e2_norm[lane] += std::fabs(e2[k][lane]);
+    }
+  }
+
+  void clear(int lane) { set(lane, vec3(anchor[0], anchor[1], anchor[2]), vec3(0, 0, 0), vec3(0, 0, 0)); }
+};
+
+// Ray converted once per query into the float form the kernels use. The origin stays in double
+// until it is made relative to a packet's anchor.
+struct PacketRay
+{
+  double origin[3];
+  float dir[3];
+  float dir_norm; // L1 norm of dir
+
+  explicit PacketRay(const ray &r)
+  {
+    dir_norm = 0.0f;
+    for (int k = 0; k < 3; ++k)
+    {
+      origin[k] = r.origin[k];
+      dir[k] = static_cast<float>(r.direction[k]);
+      dir_norm += std::fabs(dir[k]);
+    }
+  }
+
+  float org(const double *anchor, int k) const { return static_cast<float>(origin[k] - anchor[k]); }
+};
+
+// Moller-Trumbore kernels. In float the test is only a filter: every lane it cannot rule out is
+// returned in a bitmask and decided by the exact double-precision Triangle::intersect, so hits
+// and the parallel-ray test stay exactly those of Triangle::hit. To stay conservative the kernels
+// never divide. They compare u * det, v * det and t * det, flipped to the sign of det, against
+// bounds widened by the rounding error of each triple product. For a * (b x c) that error is at
+// most a few ulps of |a|_1 |b|_1 |c|_1. The vector from the vertex to the ray origin also carries
+// the absolute error of rounding both to float, which its bound covers with their norms. Lanes
+// whose |det| is within its error bound may have either sign, so they go to the exact test
+// unless the triangle is empty.
+class TrianglePacketKernels
+{
+public:
+  // 16 ulps of 1: the rounding of the ray, the vertices and the edges to float, plus that of the
+  // cross and dot products, with room to spare
+  static constexpr float error_scale = 16.0f * 5.9604645e-8f;
+
+  template <int N>
+  static int intersect_scalar(const TrianglePacket<N> &p, const PacketRay &r, float t_min, float t_max)
+  {
+    const float org[3] = {r.org(p.anchor, 0), r.org(p.anchor, 1), r.org(p.anchor, 2)};
+    const float org_norm = std::fabs(org[0]) + std::fabs(org[1]) + std::fabs(org[2]);
+    // The bounds on |det| that make the t range widest
+    const float t_min_side = t_min >= 0.0f ? -1.0f : 1.0f;
+    const float t_max_side = t_max >= 0.0f ? 1.0f : -1.0f;
+    int mask = 0;
+    for (int i = 0; i < N; ++i)
+    {
+      float hx = r.dir[1] * p.e2[2][i] - r.dir[2] * p.e2[1][i];
+      float hy = r.dir[2] * p.e2[0][i] - r.dir[0] * p.e2[2][i];
+      float hz = r.dir[0] * p.e2[1][i] - r.dir[1] * p.e2[0][i];
+      float det = p.e1[0][i] * hx + p.e1[1][i] * hy + p.e1[2][i] * hz;
+
+      float sx = org[0] - p.v0[0][i];
+      float sy = org[1] - p.v0[1][i];
+      float sz = org[2] - p.v0[2][i];
+      float u = sx * hx + sy * hy + sz * hz;
+
+      float qx = sy * p.e1[2][i] - sz * p.e1[1][i];
+      float qy = sz * p.e1[0][i] - sx * p.e1[2][i];
+      float qz = sx * p.e1[1][i] - sy * p.e1[0][i];
+      float v = r.dir[0] * qx + r.dir[1] * qy + r.dir[2] * qz;
+      float t = p.e2[0][i] * qx + p.e2[1][i] * qy + p.e2[2][i] * qz;
+
+      float det_abs = std::fabs(det);
+      if (det < 0.0f)
+      {
+        u = -u;
+        v = -v;
+        t = -t;
+      }
+
+      float s_norm = std::fabs(sx) + std::fabs(sy) + std::fabs(sz) + org_norm + p.v0_norm[i];
+      float det_err = error_scale * p.e1_norm[i] * p.e2_norm[i] * r.dir_norm;
+      float u_err = error_scale * p.e2_norm[i] * r.dir_norm * s_norm;
+      float v_err = error_scale * p.e1_norm[i] * r.dir_norm * s_norm;
+      float t_err = error_scale * p.e1_norm[i] * p.e2_norm[i] * s_norm;
+
+      bool candidate;
+      if (det_abs <= det_err)
+        candidate = det_err > 0.0f;
+      else
+        candidate = u >= -u_err && v >= -v_err && u + v <= det_abs + det_err + u_err + v_err &&
+                    t + t_err >= t_min * (det_abs + t_min_side * det_err) &&
+                    t - t_err <= t_max * (det_abs + t_max_side * det_err);
+      if (candidate)
+        mask |= 1 << i;
+    }
+    return mask;
+  }
+
+#if defined(RT_SIMD_SSE)
+  static int intersect_sse(const TrianglePacket<4> &p, const PacketRay &r, float t_min, float t_max)
+  {
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 dx = _mm_set1_ps(r.dir[0]), dy = _mm_set1_ps(r.dir[1]), dz = _mm_set1_ps(r.dir[2]);
+    __m128 e1x = _mm_loadu_ps(p.e1[0]), e1y = _mm_loadu_ps(p.e1[1]), e1z = _mm_loadu_ps(p.e1[2]);
+    __m128 e2x = _mm_loadu_ps(p.e2[0]), e2y = _mm_loadu_ps(p.e2[1]), e2z = _mm_loadu_ps(p.e2[2]);
+
+    __m128 hx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    __m128 hy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    __m128 hz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, hx), _mm_mul_ps(e1y, hy)), _mm_mul_ps(e1z, hz));
+
+    const float ox = r.org(p.anchor, 0), oy = r.org(p.anchor, 1), oz = r.org(p.anchor, 2);
+    __m128 sx = _mm_sub_ps(_mm_set1_ps(ox), _mm_loadu_ps(p.v0[0]));
+    __m128 sy = _mm_sub_ps(_mm_set1_ps(oy), _mm_loadu_ps(p.v0[1]));
+    __m128 sz = _mm_sub_ps(_mm_set1_ps(oz), _mm_loadu_ps(p.v0[2]));
+    __m128 u = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, hx), _mm_mul_ps(sy, hy)), _mm_mul_ps(sz, hz));
+
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+    __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz));
+    __m128 t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz));
+
+    __m128 det_sign = _mm_and_ps(det, sign);
+    __m128 det_abs = _mm_andnot_ps(sign, det);
+    u = _mm_xor_ps(u, det_sign);
+    v = _mm_xor_ps(v, det_sign);
+    t = _mm_xor_ps(t, det_sign);
+
+    const float org_norm = std::fabs(ox) + std::fabs(oy) + std::fabs(oz);
+    __m128 s_norm = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(sign, sx), _mm_andnot_ps(sign, sy)), _mm_andnot_ps(sign, sz));
+    s_norm = _mm_add_ps(s_norm, _mm_add_ps(_mm_set1_ps(org_norm), _mm_loadu_ps(p.v0_norm)));
+    __m128 e1n = _mm_mul_ps(_mm_loadu_ps(p.e1_norm), _mm_set1_ps(error_scale));
+    __m128 e2n = _mm_loadu_ps(p.e2_norm);
+    __m128 dn = _mm_set1_ps(r.dir_norm);
+    __m128 e12 = _mm_mul_ps(e1n, e2n);
+    __m128 det_err = _mm_mul_ps(e12, dn);
+    __m128 u_err = _mm_mul_ps(_mm_mul_ps(e2n, _mm_set1_ps(error_scale)), _mm_mul_ps(dn, s_norm));
+    __m128 v_err = _mm_mul_ps(e1n, _mm_mul_ps(dn, s_norm));
+    __m128 t_err = _mm_mul_ps(e12, s_norm);
+
+    __m128 t_low = _mm_mul_ps(_mm_set1_ps(t_min), t_min >= 0.0f ? _mm_sub_ps(det_abs, det_err) : _mm_add_ps(det_abs, det_err));
+    __m128 t_high = _mm_mul_ps(_mm_set1_ps(t_max), t_max >= 0.0f ? _mm_add_ps(det_abs, det_err) : _mm_sub_ps(det_abs, det_err));
+    __m128 inside = _mm_and_ps(_mm_cmpge_ps(u, _mm_xor_ps(u_err, sign)), _mm_cmpge_ps(v, _mm_xor_ps(v_err, sign)));
+    inside = _mm_and_ps(inside, _mm_cmple_ps(_mm_add_ps(u, v), _mm_add_ps(_mm_add_ps(det_abs, det_err), _mm_add_ps(u_err, v_err))));
+    inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(t, t_err), t_low));
+    inside = _mm_and_ps(inside, _mm_cmple_ps(_mm_sub_ps(t, t_err), t_high));
+    inside = _mm_and_ps(inside, _mm_cmpgt_ps(det_abs, det_err));
+
+    __m128 uncertain = _mm_and_ps(_mm_cmple_ps(det_abs, det_err), _mm_cmpgt_ps(det_err, _mm_setzero_ps()));
+    return _mm_movemask_ps(_mm_or_ps(inside, uncertain));
+  }
+#endif
+
+#if defined(RT_SIMD_AVX2)
+  RT_TARGET_AVX2 static int intersect_avx2(const TrianglePacket<8> &p, const PacketRay &r, float t_min, float t_max)
+  {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 dx = _mm256_set1_ps(r.dir[0]), dy = _mm256_set1_ps(r.dir[1]), dz = _mm256_set1_ps(r.dir[2]);
+    __m256 e1x = _mm256_loadu_ps(p.e1[0]), e1y = _mm256_loadu_ps(p.e1[1]), e1z = _mm256_loadu_ps(p.e1[2]);
+    __m256 e2x = _mm256_loadu_ps(p.e2[0]), e2y = _mm256_loadu_ps(p.e2[1]), e2z = _mm256_loadu_ps(p.e2[2]);
+
+    __m256 hx = _mm256_fmsub_ps(dy, e2z, _mm256_mul_ps(dz, e2y));
+    __m256 hy = _mm256_fmsub_ps(dz, e2x, _mm256_mul_ps(dx, e2z));
+    __m256 hz = _mm256_fmsub_ps(dx, e2y, _mm256_mul_ps(dy, e2x));
+    __m256 det = _mm256_fmadd_ps(e1x, hx, _mm256_fmadd_ps(e1y, hy, _mm256_mul_ps(e1z, hz)));
+
+    const float ox = r.org(p.anchor, 0), oy = r.org(p.anchor, 1), oz = r.org(p.anchor, 2);
+    __m256 sx = _mm256_sub_ps(_mm256_set1_ps(ox), _mm256_loadu_ps(p.v0[0]));
+    __m256 sy = _mm256_sub_ps(_mm256_set1_ps(oy), _mm256_loadu_ps(p.v0[1]));
+    __m256 sz = _mm256_sub_ps(_mm256_set1_ps(oz), _mm256_loadu_ps(p.v0[2]));
+    __m256 u = _mm256_fmadd_ps(sx, hx, _mm256_fmadd_ps(sy, hy, _mm256_mul_ps(sz, hz)));
+
+    __m256 qx = _mm256_fmsub_ps(sy, e1z, _mm256_mul_ps(sz, e1y));
+    __m256 qy = _mm256_fmsub_ps(sz, e1x, _mm256_mul_ps(sx, e1z));
+    __m256 qz = _mm256_fmsub_ps(sx, e1y, _mm256_mul_ps(sy, e1x));
+    __m256 v = _mm256_fmadd_ps(dx, qx, _mm256_fmadd_ps(dy, qy, _mm256_mul_ps(dz, qz)));
+    __m256 t = _mm256_fmadd_ps(e2x, qx, _mm256_fmadd_ps(e2y, qy, _mm256_mul_ps(e2z, qz)));
+
+    __m256 det_sign = _mm256_and_ps(det, sign);
+    __m256 det_abs = _mm256_andnot_ps(sign, det);
+    u = _mm256_xor_ps(u, det_sign);
+    v = _mm256_xor_ps(v, det_sign);
+    t = _mm256_xor_ps(t, det_sign);
+
+    const float org_norm = std::fabs(ox) + std::fabs(oy) + std::fabs(oz);
+    __m256 s_norm = _mm256_add_ps(_mm256_add_ps(_mm256_andnot_ps(sign, sx), _mm256_andnot_ps(sign, sy)), _mm256_andnot_ps(sign, sz));
+    s_norm = _mm256_add_ps(s_norm, _mm256_add_ps(_mm256_set1_ps(org_norm), _mm256_loadu_ps(p.v0_norm)));
+    __m256 e1n = _mm256_mul_ps(_mm256_loadu_ps(p.e1_norm), _mm256_set1_ps(error_scale));
+    __m256 e2n = _mm256_loadu_ps(p.e2_norm);
+    __m256 dn = _mm256_set1_ps(r.dir_norm);
+    __m256 e12 = _mm256_mul_ps(e1n, e2n);
+    __m256 det_err = _mm256_mul_ps(e12, dn);
+    __m256 u_err = _mm256_mul_ps(_mm256_mul_ps(e2n, _mm256_set1_ps(error_scale)), _mm256_mul_ps(dn, s_norm));
+    __m256 v_err = _mm256_mul_ps(e1n, _mm256_mul_ps(dn, s_norm));
+    __m256 t_err = _mm256_mul_ps(e12, s_norm);
+
+    __m256 t_low = _mm256_mul_ps(_mm256_set1_ps(t_min), t_min >= 0.0f ? _mm256_sub_ps(det_abs, det_err) : _mm256_add_ps(det_abs, det_err));
+    __m256 t_high = _mm256_mul_ps(_mm256_set1_ps(t_max), t_max >= 0.0f ? _mm256_add_ps(det_abs, det_err) : _mm256_sub_ps(det_abs, det_err));
+    __m256 inside = _mm256_and_ps(_mm256_cmp_ps(u, _mm256_xor_ps(u_err, sign), _CMP_GE_OQ), _mm256_cmp_ps(v, _mm256_xor_ps(v_err, sign), _CMP_GE_OQ));
+    inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_add_ps(_mm256_add_ps(det_abs, det_err), _mm256_add_ps(u_err, v_err)), _CMP_LE_OQ));
+    inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(t, t_err), t_low, _CMP_GE_OQ));
+    inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_sub_ps(t, t_err), t_high, _CMP_LE_OQ));
+    inside = _mm256_and_ps(inside, _mm256_cmp_ps(det_abs, det_err, _CMP_GT_OQ));
+
+    __m256 uncertain = _mm256_and_ps(_mm256_cmp_ps(det_abs, det_err, _CMP_LE_OQ), _mm256_cmp_ps(det_err, _mm256_setzero_ps(), _CMP_GT_OQ));
+    return _mm256_movemask_ps(_mm256_or_ps(inside, uncertain));
+  }
+#endif
+};
+
+// Packets for every leaf of a BVH over triangles in leaf order. A leaf of count triangles starting
+// at first gets ceil(count / N) consecutive packets; the last one is padded with empty lanes.
+template <int N>
+class TrianglePackets
+{
+public:
+  std::vector<TrianglePacket<N>, AlignedAllocator<TrianglePacket<N>>> packets;
+
+  // triangle(i, a, e1, e2) fetches vertex a and the edges of triangle i in leaf order
+  template <typename TriangleFn>
+  void build(const FlatBVH &tree, size_t triangle_count, TriangleFn triangle, SIMDLevel simd = SIMD::level())
+  {
+    level = SIMDLevel::scalar;
+#if defined(RT_SIMD_SSE)
+    if (N == 4 && simd >= SIMDLevel::sse)
+      level = SIMDLevel::sse;
+#endif
+#if defined(RT_SIMD_AVX2)
+    if (N == 8 && simd >= SIMDLevel::avx2)
+      level = SIMDLevel::avx2;
+#endif
+
+    packets.clear();
+    first_packet.assign(triangle_count, 0);
+    for (const LinearBVHNode &node : tree.nodes)
+    {
+      if (!node.is_leaf())
+        continue;
+
+      first_packet[node.offset] = static_cast<uint32_t>(packets.size());
+      for (uint32_t base = 0; base < node.count; base += N)
+      {
+        TrianglePacket<N> packet;
+        vec3 anchor, e1, e2;
+        triangle(node.offset + base, anchor, e1, e2);
+        for (int k = 0; k < 3; ++k)
+          packet.anchor[k] = anchor[k];
+
+        for (int lane = 0; lane < N; ++lane)
+        {
+          if (base + lane >= node.count)
+          {
+            packet.clear(lane);
+            continue;
+          }
+          vec3 a;
+          triangle(node.offset + base + lane, a, e1, e2);
+          packet.set(lane, a, e1, e2);
+        }
+        packets.push_back(packet);
+      }
+    }
+  }
+
+  SIMDLevel kernel() const { return level; }
+
+  // Runs exact(i, t_max) on every triangle i of the leaf [first, first + count) the packet test
+  // cannot rule out. exact returns true on a confirmed hit and lowers t_max for closest-hit
+  // queries; any_hit stops at the first one.
+  template <typename ExactFn>
+  bool intersect(uint32_t first, uint32_t count, const PacketRay &r, real t_min, real &t_max, bool any_hit, ExactFn &&exact) const
+  {
+    bool hit_anything = false;
+    const TrianglePacket<N> *packet = &packets[first_packet[first]];
+    // The t range in float, rounded outward so the kernels see all of [t_min, t_max]
+    const float t_low = round_down(t_min);
+    for (uint32_t base = 0; base < count; base += N, ++packet)
+    {
+      int mask = dispatch(*packet, r, t_low, round_up(t_max));
+      while (mask != 0)
+      {
+        int lane = __builtin_ctz(mask);
+        mask &= mask - 1;
+        if (exact(first + base + lane, t_max))
+        {
+          if (any_hit)
+            return true;
+          hit_anything = true;
+        }
+      }
+    }
+    return hit_anything;
+  }
+
+private:
+  // Packet index of each leaf's first packet, indexed by the leaf's first triangle
+  std::vector<uint32_t> first_packet;
+  SIMDLevel level = SIMDLevel::scalar;
+
+  static float round_down(double d)
+  {
+    float f = static_cast<float>(d);
+    return f > d ? std::nextafter(f, -INFINITY) : f;
+  }
+
+  static float round_up(double d)
+  {
+    float f = static_cast<float>(d);
+    return f < d ? std::nextafter(f, INFINITY) : f;
+  }
+
+  int dispatch(const TrianglePacket<4> &p, const PacketRay &r, float t_min, float t_max) const
+  {
+#if defined(RT_SIMD_SSE)
+    if (level == SIMDLevel::sse)
+      return TrianglePacketKernels::intersect_sse(p, r, t_min, t_max);
+#endif
+    return TrianglePacketKernels::intersect_scalar<4>(p, r, t_min, t_max);
+  }
+
+  int dispatch(const TrianglePacket<8> &p, const PacketRay &r, float t_min, float t_max) const
+  {
+#if defined(RT_SIMD_AVX2)
+    if (level == SIMDLevel::avx2)
+      return TrianglePacketKernels::intersect_avx2(p, r, t_min, t_max);
+#endif
+    return TrianglePacketKernels::intersect_scalar<8>(p, r, t_min, t_max);
+  }
+};
+
+#endif // TRIANGLE_PACKET_H
@@ -3,11 +3,12 @@
 
 #include <cmath>
 #include <cstdlib>
-#include <ctime>
-#include <random>
+#include <cstdint>
 #include <iostream>
-#include <sstream>
-#include <fstream>
+#include <functional>
+#include <vector>
+#include "rng.h"
+#include "thread_pool.h"
 // #include "color.h"
 
 class Util
@@ -29,27 +30,49 @@ public:
     return degrees * pi / 180.0;
   }
 
+  // The calling thread's random number generator. Every thread has its own, so drawing numbers
+  // never contends; reseed it to make what follows reproducible.
+  static PCG32 &rng()
+  {
+    static thread_local PCG32 generator;
+    return generator;
+  }
+
+  // Restart the calling thread's generator on one stream of a seed
+  static void seed(uint64_t seed, uint64_t stream = 0)
+  {
+    rng().seed(seed, stream);
+  }
+
   // Generate a random double in the range [0, 1)
   static double random_double()
   {
-    static std::random_device rd;
-    static std::mt19937 gen(rd()); // Mersenne Twister RNG
-    static std::uniform_real_distribution<> dis(0.0, 1.0);
-    return dis(gen);
+    return rng().next_double();
   }
 
   // Generate a random double in a specified range [min, max)
   static double random_double_range(double min, double max)
   {
-    std::uniform_real_distribution<> dis(min, max);
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    return dis(gen);
+    return min + (max - min) * rng().next_double();
   }
 
+  // Generate a random int in [a, b]
   static int random_int(int a, int b)
   {
-    return a + rand() % (b - a + 1);
+    return a + static_cast<int>(rng().next_below(static_cast<uint32_t>(b - a + 1)));
+  }
+
+  // Number of threads to use when a setting asks for "all of them": the size of the shared pool
+  static unsigned default_threads()
+  {
+    return ThreadPool::shared().size();
+  }
+
+  // Run fn(i) for every i in [0, count) on up to `threads` threads of the shared pool (the caller
+  // is one of them), each pulling the next index from a shared counter
+  static void parallel_for(size_t count, unsigned threads, const std::function<void(size_t)> &fn)
+  {
+    ThreadPool::shared().parallel_for(count, threads, fn);
   }
 
   // Clamp a number between a specified min and max range
@@ -68,55 +91,6 @@ public:
       return num;
     }
   }
-
-  static void print_obj_bounding_box(const std::string &filename)
-  {
-    std::ifstream file(filename);
-    if (!file.is_open())
-    {
-      std::cerr << "Could not open OBJ file: " << filename << std::endl;
-      return;
-    }
-
-    // Initialize min/max values to extreme values
-    double minX = std::numeric_limits<double>::infinity();
-    double maxX = -std::numeric_limits<double>::infinity();
-    double minY = std::numeric_limits<double>::infinity();
-    double maxY = -std::numeric_limits<double>::infinity();
-    double minZ = std::numeric_limits<double>::infinity();
-    double maxZ = -std::numeric_limits<double>::infinity();
-
-    std::string line;
-    while (std::getline(file, line))
-    {
-      std::istringstream iss(line);
-      std::string prefix;
-      iss >> prefix;
-
-      if (prefix == "v")
-      {
-        // Parse vertex (v x y z)
-        double x, y, z;
-        iss >> x >> y >> z;
-
-        // Update the bounding box
-        minX = std::min(minX, x);
-        maxX = std::max(maxX, x);
-        minY = std::min(minY, y);
-        maxY = std::max(maxY, y);
-        minZ = std::min(minZ, z);
-        maxZ = std::max(maxZ, z);
-      }
-    }
-
-    file.close();
-
-    // Print the min/max values
-    std::cout << "Bounding box:" << std::endl;
-    std::cout << "X: [" << minX << ", " << maxX << "]" << std::endl;
-    std::cout << "Y: [" << minY << ", " << maxY << "]" << std::endl;
-    std::cout << "Z: [" << minZ << ", " << maxZ << "]" << std::endl;
-  }
 };
 // const double Util::pi = 3.14159;
 #endif // UTIL_H
\ No newline at end of file
@@ -0,0 +1,382 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "flat_bvh.h"
+#include "simd.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Node of an N-wide BVH. Child boxes are stored structure-of-arrays so all N slab tests run in
+// one SIMD kernel. bounds[0..2] hold min x/y/z and bounds[3..5] max x/y/z, one lane per child.
+// Unused slots carry an inverted box, which every kernel rejects without a special case.
+template <int N>
+struct alignas(32) WideBVHNode
+{
+  float bounds[6][N];
+  uint32_t child[N]; // Interior child: node index. Leaf child: first entry in the primitive order
+  uint16_t count[N]; // Primitives in a leaf child, 0 for interior children and empty slots
+
+  void clear_slot(int slot)
+  {
+    for (int a = 0; a < 3; ++a)
+    {
+      bounds[a][slot] = INFINITY;
+      bounds[a + 3][slot] = -INFINITY;
+    }
+    child[slot] = 0;
+    count[slot] = 0;
+  }
+};
+
+// Ray converted once per traversal into the float form the kernels use. near_plane[a] picks the
+// bounds row the ray enters through on axis a (min for positive directions, max for negative).
+// Rounding the origin to float moves every slab distance on axis a by (origin - org) * inv_dir,
+// an absolute error that grows with the origin's magnitude, so t_pad holds the largest of these
+// shifts and the kernels widen each box by it.
+struct WideRay
+{
+  float org[3];
+  float inv_dir[3];
+  float t_pad;
+  int near_plane[3];
+  int far_plane[3];
+
+  explicit WideRay(const ray &r)
+  {
+    double pad = 0.0;
+    for (int a = 0; a < 3; ++a)
+    {
+      org[a] = static_cast<float>(r.origin[a]);
+      inv_dir[a] = static_cast<float>(r.inv_direction[a]);
+      near_plane[a] = r.sign[a] ? a + 3 : a;
+      far_plane[a] = r.sign[a] ? a : a + 3;
+
+      // Parallel axes need no margin: the bounds are floats and rounding is monotonic, so the
+      // rounded origin never crosses a plane the exact one is outside of
+      double inv = static_cast<double>(r.inv_direction[a]);
+      if (std::isfinite(inv))
+        pad = std::max(pad, std::fabs((static_cast<double>(r.origin[a]) - org[a]) * inv));
+    }
+    t_pad = pad > 0.0 ? std::nextafter(static_cast<float>(pad * 1.0001), INFINITY) : 0.0f;
+  }
+};
+
+// Slab test kernels. Each one writes the entry distance of every child to t_near and returns a
+// bitmask of the children whose box overlaps [t_min, t_max]. A NaN slab (origin on a plane of an
+// axis the ray is parallel to) leaves the interval alone, so those boxes are kept rather than lost.
+// The far distance is widened by a few ulps to cover the relative rounding of the subtraction,
+// the product and the inverse direction, and both ends by the ray's t_pad for the rounding of
+// its origin. The entry distances written out include the margin, so pruning on them is safe.
+class WideBVHKernels
+{
+public:
+  static constexpr float far_scale = 1.0f + 4.0f * 1.1920929e-7f;
+
+  template <int N>
+  static int intersect_scalar(const WideBVHNode<N> &node, const WideRay &r, float t_min, float t_max, float *t_near)
+  {
+    int mask = 0;
+    for (int i = 0; i < N; ++i)
+    {
+      float t0 = t_min, t1 = t_max;
+      for (int a = 0; a < 3; ++a)
+      {
+        float tn = (node.bounds[r.near_plane[a]][i] - r.org[a]) * r.inv_dir[a];
+        float tf = (node.bounds[r.far_plane[a]][i] - r.org[a]) * r.inv_dir[a];
+        t0 = tn > t0 ? tn : t0;
+        t1 = tf < t1 ? tf : t1;
+      }
+      t0 -= r.t_pad;
+      t_near[i] = t0;
+      if (t0 <= t1 * far_scale + r.t_pad)
+        mask |= 1 << i;
+    }
+    return mask;
+  }
+
+#if defined(RT_SIMD_SSE)
+  static int intersect_sse(const WideBVHNode<4> &node, const WideRay &r, float t_min, float t_max, float *t_near)
+  {
+    __m128 t0 = _mm_set1_ps(t_min);
+    __m128 t1 = _mm_set1_ps(t_max);
+    for (int a = 0; a < 3; ++a)
+    {
+      __m128 o = _mm_set1_ps(r.org[a]);
+      __m128 inv = _mm_set1_ps(r.inv_dir[a]);
+      __m128 tn = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[r.near_plane[a]]), o), inv);
+      __m128 tf = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[r.far_plane[a]]), o), inv);
+      // maxps/minps return the second operand when either is NaN
+      t0 = _mm_max_ps(tn, t0);
+      t1 = _mm_min_ps(tf, t1);
+    }
+    __m128 pad = _mm_set1_ps(r.t_pad);
+    t0 = _mm_sub_ps(t0, pad);
+    _mm_storeu_ps(t_near, t0);
+    t1 = _mm_add_ps(_mm_mul_ps(t1, _mm_set1_ps(far_scale)), pad);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+  }
+#endif
+
+#if defined(RT_SIMD_AVX2)
+  RT_TARGET_AVX2 static int intersect_avx2(const WideBVHNode<8> &node, const WideRay &r, float t_min, float t_max, float *t_near)
+  {
+    __m256 t0 = _mm256_set1_ps(t_min);
+    __m256 t1 = _mm256_set1_ps(t_max);
+    for (int a = 0; a < 3; ++a)
+    {
+      __m256 inv = _mm256_set1_ps(r.inv_dir[a]);
+      __m256 o = _mm256_set1_ps(r.org[a]);
+      __m256 tn = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[r.near_plane[a]]), o), inv);
+      __m256 tf = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[r.far_plane[a]]), o), inv);
+      t0 = _mm256_max_ps(tn, t0);
+      t1 = _mm256_min_ps(tf, t1);
+    }
+    __m256 pad = _mm256_set1_ps(r.t_pad);
+    t0 = _mm256_sub_ps(t0, pad);
+    _mm256_storeu_ps(t_near, t0);
+    t1 = _mm256_add_ps(_mm256_mul_ps(t1, _mm256_set1_ps(far_scale)), pad);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+  }
+#endif
+};
+
+// N-wide BVH collapsed from a binary FlatBVH. Leaves keep the binary tree's primitive ranges, so
+// the owner's leaf callback is shared between the two layouts.
+template <int N>
+class WideBVH
+{
+public:
+  std::vector<WideBVHNode<N>, AlignedAllocator<WideBVHNode<N>>> nodes;
+
+  // Collapse a binary tree, choosing the kernel for this CPU. Requests for a SIMD level the
+  // width cannot use (AVX2 on BVH4, SSE on BVH8) fall back to the next one down.
+  void build(const FlatBVH &binary, SIMDLevel simd = SIMD::level())
+  {
+    nodes.clear();
+    level = SIMDLevel::scalar;
+#if defined(RT_SIMD_SSE)
+    if (N == 4 && simd >= SIMDLevel::sse)
+      level = SIMDLevel::sse;
+#endif
+#if defined(RT_SIMD_AVX2)
+    if (N == 8 && simd >= SIMDLevel::avx2)
+      level = SIMDLevel::avx2;
+#endif
+
+    if (binary.nodes.empty())
+      return;
+
+    nodes.reserve(binary.nodes.size() / (N / 2) + 1);
+    collapse(binary, 0);
+  }
+
+  SIMDLevel kernel() const { return level; }
+
+  // Same contract as FlatBVH::intersect. Children are visited nearest first and any stack entry
+  // whose entry distance is beyond the closest hit so far is skipped when popped.
+  template <typename LeafFn>
+  bool intersect(const ray &r, real t_min, real t_max, LeafFn &&leaf) const
+  {
+    if (nodes.empty())
+      return false;
+
+    struct Entry
+    {
+      uint32_t child;
+      uint32_t count;
+      float t;
+    };
+
+    const WideRay wr(r);
+    Entry stack[stack_capacity];
+    int stack_size = 0;
+    stack[stack_size++] = {0, 0, static_cast<float>(t_min)};
+    bool hit_anything = false;
+
+    while (stack_size > 0)
+    {
+      Entry entry = stack[--stack_size];
+      if (entry.t > t_max)
+        continue;
+
+      if (entry.count > 0)
+      {
+        if (leaf(entry.child, entry.count, t_max))
+          hit_anything = true;
+        continue;
+      }
+
+      const WideBVHNode<N> &node = nodes[entry.child];
+      float t_near[N];
+      int mask = test_children(node, wr, static_cast<float>(t_min), static_cast<float>(t_max), t_near);
+      if (mask == 0)
+        continue;
+
+      // Sort the hit children by entry distance, then push farthest first so the nearest pops next
+      int order[N];
+      int hits = 0;
+      for (int i = 0; i < N; ++i)
+      {
+        if (!(mask & (1 << i)))
+          continue;
+        int j = hits++;
+        while (j > 0 && t_near[order[j - 1]] > t_near[i])
+        {
+          order[j] = order[j - 1];
+          --j;
+        }
+        order[j] = i;
+      }
+
+      for (int k = hits - 1; k >= 0; --k)
+      {
+        int i = order[k];
+        stack[stack_size++] = {node.child[i], node.count[i], t_near[i]};
+      }
+    }
+
+    return hit_anything;
+  }
+
+  // Same contract as FlatBVH::intersect_any. Hit children are pushed in slot order, since
+  // sorting them buys nothing when any hit ends the query.
+  template <typename LeafFn>
+  bool intersect_any(const ray &r, real t_min, real t_max, LeafFn &&leaf) const
+  {
+    if (nodes.empty())
+      return false;
+
+    struct Entry
+    {
+      uint32_t child;
+      uint32_t count;
+    };
+
+    const WideRay wr(r);
+    Entry stack[stack_capacity];
+    int stack_size = 0;
+    stack[stack_size++] = {0, 0};
+
+    while (stack_size > 0)
+    {
+      Entry entry = stack[--stack_size];
+      if (entry.count > 0)
+      {
+        if (leaf(entry.child, entry.count))
+          return true;
+        continue;
+      }
+
+      const WideBVHNode<N> &node = nodes[entry.child];
+      float t_near[N];
+      int mask = test_children(node, wr, static_cast<float>(t_min), static_cast<float>(t_max), t_near);
+      while (mask != 0)
+      {
+        int i = __builtin_ctz(mask);
+        mask &= mask - 1;
+        stack[stack_size++] = {node.child[i], node.count[i]};
+      }
+    }
+
+    return false;
+  }
+
+private:
+  // Each level leaves at most N - 1 entries behind, and a collapsed tree is never deeper than
+  // the binary one it came from
+  static const int stack_capacity = FlatBVH::max_depth * (N - 1) + 1;
+
+  SIMDLevel level = SIMDLevel::scalar;
+
+  int test_children(const WideBVHNode<N> &node, const WideRay &r, float t_min, float t_max, float *t_near) const
+  {
+    return dispatch(node, r, t_min, t_max, t_near);
+  }
+
+  int dispatch(const WideBVHNode<4> &node, const WideRay &r, float t_min, float t_max, float *t_near) const
+  {
+#if defined(RT_SIMD_SSE)
+    if (level == SIMDLevel::sse)
+      return WideBVHKernels::intersect_sse(node, r, t_min, t_max, t_near);
+#endif
+    return WideBVHKernels::intersect_scalar<4>(node, r, t_min, t_max, t_near);
+  }
+
+  int dispatch(const WideBVHNode<8> &node, const WideRay &r, float t_min, float t_max, float *t_near) const
+  {
+#if defined(RT_SIMD_AVX2)
+    if (level == SIMDLevel::avx2)
+      return WideBVHKernels::intersect_avx2(node, r, t_min, t_max, t_near);
+#endif
+    return WideBVHKernels::intersect_scalar<8>(node, r, t_min, t_max, t_near);
+  }
+
+  // Emit the wide node for binary node `root` and its subtree, returning its index. Children are
+  // gathered by repeatedly opening the interior slot with the largest surface area.
+  uint32_t collapse(const FlatBVH &binary, uint32_t root)
+  {
+    std::vector<uint32_t> slots;
+    slots.push_back(root);
+
+    while (static_cast<int>(slots.size()) < N)
+    {
+      int best = -1;
+      double best_area = -1.0;
+      for (size_t i = 0; i < slots.size(); ++i)
+      {
+        const LinearBVHNode &candidate = binary.nodes[slots[i]];
+        if (candidate.is_leaf())
+          continue;
+        double area = candidate.bounds().surface_area();
+        if (area > best_area)
+        {
+          best_area = area;
+          best = static_cast<int>(i);
+        }
+      }
+      if (best < 0)
+        break;
+
+      uint32_t opened = slots[best];
+      slots[best] = opened + 1;
+      slots.push_back(binary.nodes[opened].offset);
+    }
+
+    uint32_t index = static_cast<uint32_t>(nodes.size());
+    nodes.push_back(WideBVHNode<N>());
+
+    for (int i = 0; i < N; ++i)
+    {
+      if (i >= static_cast<int>(slots.size()))
+      {
+        nodes[index].clear_slot(i);
+        continue;
+      }
+
+      const LinearBVHNode &source = binary.nodes[slots[i]];
+      for (int a = 0; a < 3; ++a)
+      {
+        nodes[index].bounds[a][i] = source.bounds_min[a];
+        nodes[index].bounds[a + 3][i] = source.bounds_max[a];
+      }
+
+      if (source.is_leaf())
+      {
+        nodes[index].child[i] = source.offset;
+        nodes[index].count[i] = source.count;
+      }
+      else
+      {
+        uint32_t child = collapse(binary, slots[i]);
+        nodes[index].child[i] = child;
+        nodes[index].count[i] = 0;
+      }
+    }
+
+    return index;
+  }
+};
+
+#endif // WIDE_BVH_H
\ No newline at end of file